@@ -11,6 +11,7 @@
 #include <iomanip>
 
 const size_t k_max_msg = 4096;
+const size_t k_max_resp = 64 << 20; // must match the server
 
 enum
 {
@@ -229,15 +230,15 @@ static int32_t read_res(int fd)
     uint32_t len = 0;
     memcpy(&len, lenbuf, 4);
 
-    if (len > k_max_msg)
+    if (len > k_max_resp)
     {
         msg("Response too long");
         return -1;
     }
 
     // Now read the actual payload
-    char rbuf[k_max_msg];
-    err = read_full(fd, rbuf, len);
+    std::vector<char> rbuf(len);
+    err = read_full(fd, rbuf.data(), len);
     if (err)
     {
         msg("read() error");
@@ -245,7 +246,7 @@ static int32_t read_res(int fd)
     }
 
     // Process the response - passing only the payload (not the length prefix)
-    return on_response(reinterpret_cast<const uint8_t *>(rbuf), len);
+    return on_response(reinterpret_cast<const uint8_t *>(rbuf.data()), len);
 }
 
 int32_t send_req(int fd, const std::vector<std::string> &cmd)
@@ -305,8 +306,26 @@ void print_usage()
     std::cout << "    KEYS                       - Get all keys" << std::endl;
     std::cout << "\n  Sorted Set (ZSET) Commands:" << std::endl;
     std::cout << "    ZADD <key> <score> <member> [score member ...]  - Add members to a sorted set" << std::endl;
+    std::cout << "    ZADD <key> [NX|XX] [GT|LT] [INCR] <score> <member> ...  - Add with conditions" << std::endl;
+    std::cout << "    ZINCRBY <key> <increment> <member>              - Increment the score of a member" << std::endl;
     std::cout << "    ZSCORE <key> <member>      - Get the score of a member in a sorted set" << std::endl;
     std::cout << "    ZRANGE <key> <start> <stop> [WITHSCORES]        - Get range of members by index" << std::endl;
+    std::cout << "    ZREVRANGE <key> <start> <stop> [WITHSCORES]     - Same, from the highest score down" << std::endl;
+    std::cout << "    ZRANGEPAGE <key> <cursor> <count> [WITHSCORES] [REV] - Page by cursor, start and end with 0" << std::endl;
+    std::cout << "    ZRANDMEMBER <key> [count [WITHSCORES]]          - Random members, negative count allows repeats" << std::endl;
+    std::cout << "    ZQUANTILE <key> <q> [q ...] [WITHSCORES]        - Members at quantiles q in [0, 1]" << std::endl;
+    std::cout << "    ZSUMRANGE <key> <start> <stop>                  - Count, sum, min and max of scores by index" << std::endl;
+    std::cout << "    ZSUMRANGEBYSCORE <key> <min> <max>              - Same over a score range, '(' excludes a bound" << std::endl;
+    std::cout << "    ZREM <key> <member> [member ...]                - Remove members from a sorted set" << std::endl;
+    std::cout << "    ZPOPMIN <key> [count] / ZPOPMAX <key> [count]   - Remove and return the lowest/highest members" << std::endl;
+    std::cout << "    BZPOPMIN <key> ... <timeout> / BZPOPMAX ...     - Blocking pop, waits up to timeout seconds (0 = forever)" << std::endl;
+    std::cout << "    ZUNIONSTORE <dest> <numkeys> <key> ... [WEIGHTS w ...] [AGGREGATE SUM|MIN|MAX]" << std::endl;
+    std::cout << "    ZINTERSTORE <dest> <numkeys> <key> ... [WEIGHTS w ...] [AGGREGATE SUM|MIN|MAX]" << std::endl;
+    std::cout << "    ZDIFFSTORE <dest> <numkeys> <key> ...           - Store members of the first set only" << std::endl;
+    std::cout << "\n  Persistence Commands:" << std::endl;
+    std::cout << "    SAVE                       - Write a snapshot of all keys now" << std::endl;
+    std::cout << "    BGSAVE                     - Write a snapshot from a forked child" << std::endl;
+    std::cout << "    BGREWRITEAOF               - Compact the append-only file in a forked child" << std::endl;
     std::cout << "\n  Other Commands:" << std::endl;
     std::cout << "    QUIT                       - Exit the client" << std::endl;
     std::cout << "    HELP                       - Show this help message" << std::endl;
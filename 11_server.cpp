@@ -16,14 +16,36 @@
 #include "hashtable.cpp"
 #include "zset.h"
 #include "zset.cpp"
+#include "crc32c.h"
+#include "crc32c.cpp"
+#include "snapshot.h"
+#include "snapshot.cpp"
+#include "aof.h"
+#include "aof.cpp"
+#include "dataset.h"
+#include "dataset.cpp"
 #include <algorithm>
+#include <cmath>
+#include <deque>
+#include <time.h>
+#include <random>
+#include <unordered_set>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
 const size_t k_max_msg = 4096;
+const size_t k_max_resp = 64 << 20;   // responses are not bound by the request size
+const size_t k_wbuf_keep = 64 << 10;  // larger write buffers are released once sent
 const size_t k_max_args = 16;
 enum
 {
     STATE_REQ = 0,
     STATE_RES = 1,
     STATE_END = 2,
+    STATE_BLOCK = 3, // waiting in BZPOPMIN/BZPOPMAX, no request is read
 };
 
 enum
@@ -43,6 +65,13 @@ enum
     SER_DBL = 5, // Added for double values
 };
 
+enum
+{
+    AOF_FSYNC_NO = 0,       // leave it to the kernel
+    AOF_FSYNC_EVERYSEC = 1, // a background thread syncs once a second
+    AOF_FSYNC_ALWAYS = 2,   // replies wait until the log is synced
+};
+
 enum
 {
     T_STR = 0,  // Plain string type
@@ -57,17 +86,28 @@ struct Conn
     size_t rbuf_size = 0;
     uint8_t rbuf[4 + k_max_msg];
 
-    size_t wbuf_size = 0;
+    // framed responses, appended in place by the command handlers
+    std::string wbuf;
     size_t wbuf_sent = 0;
-    uint8_t wbuf[4 + k_max_msg];
+
+    // STATE_BLOCK: the keys waited on, the deadline (0 = forever) and the pop side
+    std::vector<std::string> blocked_keys;
+    uint64_t block_deadline_ms = 0;
+    bool block_max = false;
 };
 
+// the fork-free snapshot being written, or the last one; see isnap_start()
+static uint64_t g_isnap_seq = 0;
+
 // Base entry type with type indicator
 struct Entry
 {
     struct HNode node;
     std::string key;
     int type = T_STR; // Default to string type
+    uint64_t epoch = 0; // checkpoint epoch of the last write, see entry_touch()
+    // the last fork-free snapshot that has this entry, or that started before it was created
+    uint64_t isnap = g_isnap_seq;
 };
 
 // String entry
@@ -81,22 +121,140 @@ struct StrEntry : public Entry
     }
 };
 
+// A serialized ZRANGE/ZREVRANGE reply, valid while the zset version matches
+struct ZRangeCached
+{
+    int64_t start = 0;
+    int64_t stop = 0;
+    bool reverse = false;
+    bool withscores = false;
+    uint64_t version = 0;
+    std::string resp;
+};
+
+const size_t k_zrange_cache_slots = 4;
+const size_t k_zrange_cache_max = 64 << 10;
+
 // ZSET entry
 struct ZSetEntry : public Entry
 {
     Zset zset;
+    std::vector<ZRangeCached> zrange_cache;
 
     ZSetEntry()
     {
         type = T_ZSET;
     }
+
+    ~ZSetEntry()
+    {
+        zset_dispose(&zset);
+    }
+};
+
+// Free an entry according to its type
+static void entry_del(Entry *entry)
+{
+    if (entry->type == T_ZSET)
+    {
+        delete (ZSetEntry *)entry;
+    }
+    else
+    {
+        delete (StrEntry *)entry;
+    }
+}
+
+// A fork-free snapshot in progress, see isnap_start()
+struct IncrSnapshot
+{
+    SnapWriter w;
+    std::string tmp;
+    std::vector<HTab> tabs; // the bucket arrays at the start
+    size_t tab = 0;         // the next bucket to write
+    size_t pos = 0;
+    uint64_t left = 0; // entries not written yet
 };
 
 static struct
 {
     HMap db;
+    // clients blocked on each key, in arrival order
+    std::unordered_map<std::string, std::deque<Conn *>> waiters;
+    // keys that received members while clients were waiting on them
+    std::vector<std::string> ready_keys;
+    // cache ZRANGE replies per key, enabled with --zrange-cache
+    bool zrange_cache = false;
+    // member names shared by all sorted sets, enabled with --intern-members
+    bool intern_members = false;
+    ZNamePool names;
+    // snapshot file, and the BGSAVE child while it runs
+    std::string snapshot_path = "dump.rdb";
+    pid_t save_pid = -1;
+    // threads decoding the snapshot at startup, 0 for one per core
+    size_t load_threads = 0;
+    // delta checkpoints, enabled with --checkpoint-every secs
+    uint64_t checkpoint_ms = 0;
+    uint64_t next_checkpoint_ms = 0;
+    uint64_t epoch = snap_fresh_epoch();   // of the next checkpoint
+    std::unordered_set<std::string> dirty; // keys written in this epoch
+    uint64_t base_epoch = 0;               // of the full snapshot on disk, 0 if none
+    uint64_t base_bytes = 0;
+    uint32_t delta_count = 0; // deltas written on top of it
+    uint64_t delta_bytes = 0;
+    // the checkpoint being written, by SAVE or by the child
+    bool save_full = false;
+    uint64_t save_epoch = 0;
+    std::unordered_set<std::string> saving;
+    // BGSAVE without fork, enabled with --bgsave-nofork
+    bool bgsave_nofork = false;
+    IncrSnapshot *isnap = nullptr;
+    // append-only file, enabled with --aof path
+    std::string aof_path;
+    std::atomic<int> aof_fd{-1};
+    int aof_fsync = AOF_FSYNC_EVERYSEC;
+    std::string aof_buf;                // written once per event loop iteration
+    std::string aof_block;              // aof_buf framed as a block of the file
+    std::atomic<bool> aof_dirty{false}; // written but not yet synced
+    std::mutex aof_fd_lock;             // held by the fsync thread, and to swap aof_fd
+    // the BGREWRITEAOF child, and the writes made since it was forked
+    pid_t rewrite_pid = -1;
+    std::string rewrite_buf;
+    size_t rewrite_skip = 0; // leading bytes of aof_buf the child already has
+    // read-only dataset GET is served from, enabled with --dataset path
+    std::string dataset_path;
+    DsFile dataset;
+    uint64_t dataset_check_ms = 0;
 } g_data;
 
+// the pool new sorted sets keep their member names in, if any
+static ZNamePool *zset_pool()
+{
+    return g_data.intern_members ? &g_data.names : nullptr;
+}
+
+static void isnap_write(Entry *entry);
+
+// Called before an entry is modified or deleted, and once it is created.
+// The key is marked for the next delta checkpoint; the epoch saves hashing it
+// again for every write to an already marked entry. A fork-free snapshot in
+// progress gets the old value first.
+static void entry_touch(Entry *entry)
+{
+    if (g_data.isnap && entry->isnap != g_isnap_seq)
+    {
+        isnap_write(entry);
+    }
+    if (entry->epoch != g_data.epoch)
+    {
+        entry->epoch = g_data.epoch;
+        if (g_data.checkpoint_ms)
+        {
+            g_data.dirty.insert(entry->key);
+        }
+    }
+}
+
 void die(const char *message)
 {
     perror(message);
@@ -108,6 +266,147 @@ void msg(const char *message)
     std::cout << message << std::endl;
 }
 
+// Append-only file. Write commands are logged in the request wire format,
+// in checksummed blocks (aof.h), and replayed with parse_req() and do_request().
+
+// commands that change the keyspace; BZPOPMIN/BZPOPMAX are logged
+// as the ZPOPMIN/ZPOPMAX they turn into once served
+static bool aof_is_write(const std::string &name)
+{
+    static const char *names[] = {
+        "set", "del", "zadd", "zincrby", "zunionstore", "zinterstore",
+        "zdiffstore", "zrem", "zpopmin", "zpopmax"};
+    for (const char *n : names)
+    {
+        if (strcasecmp(name.c_str(), n) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// a request exactly as received: the length prefix and the payload
+static void aof_append_raw(const uint8_t *req, uint32_t len)
+{
+    if (g_data.aof_fd < 0)
+    {
+        return;
+    }
+    g_data.aof_buf.append((const char *)&len, 4);
+    g_data.aof_buf.append((const char *)req, len);
+}
+
+static void aof_encode(std::string &out, const std::vector<std::string> &cmd)
+{
+    uint32_t len = 4;
+    for (const std::string &arg : cmd)
+    {
+        len += 4 + (uint32_t)arg.size();
+    }
+    uint32_t nargs = (uint32_t)cmd.size();
+    out.append((const char *)&len, 4);
+    out.append((const char *)&nargs, 4);
+    for (const std::string &arg : cmd)
+    {
+        uint32_t sz = (uint32_t)arg.size();
+        out.append((const char *)&sz, 4);
+        out.append(arg);
+    }
+}
+
+static void aof_append(const std::vector<std::string> &cmd)
+{
+    if (g_data.aof_fd >= 0)
+    {
+        aof_encode(g_data.aof_buf, cmd);
+    }
+}
+
+static bool write_all(int fd, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t rv = write(fd, data, size);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv <= 0)
+        {
+            return false;
+        }
+        data += rv;
+        size -= (size_t)rv;
+    }
+    return true;
+}
+
+// under appendfsync always, replies wait for the log of this iteration
+static bool aof_holds_replies()
+{
+    return g_data.aof_fsync == AOF_FSYNC_ALWAYS && !g_data.aof_buf.empty();
+}
+
+// Write the commands of this event loop iteration in one go (group commit)
+static void aof_flush()
+{
+    if (g_data.aof_fd < 0 || g_data.aof_buf.empty())
+    {
+        return;
+    }
+    g_data.aof_block.clear();
+    aof_put_block(g_data.aof_block, g_data.aof_buf.data(), g_data.aof_buf.size());
+    // a torn block cannot be rewritten in place, and a write that is not in
+    // the log must not be acknowledged: stop on write or sync errors
+    if (!write_all(g_data.aof_fd, g_data.aof_block.data(), g_data.aof_block.size()))
+    {
+        perror("AOF write() error");
+        exit(1);
+    }
+    if (g_data.rewrite_pid > 0 && g_data.aof_buf.size() > g_data.rewrite_skip)
+    {
+        aof_put_block(g_data.rewrite_buf, g_data.aof_buf.data() + g_data.rewrite_skip,
+                      g_data.aof_buf.size() - g_data.rewrite_skip);
+    }
+    g_data.rewrite_skip = 0;
+    g_data.aof_buf.clear();
+    if (g_data.aof_fsync == AOF_FSYNC_ALWAYS)
+    {
+        if (fdatasync(g_data.aof_fd) != 0)
+        {
+            perror("AOF fdatasync() error");
+            exit(1);
+        }
+    }
+    else
+    {
+        g_data.aof_dirty = true;
+    }
+}
+
+// appendfsync everysec: the event loop never waits for the disk
+static void aof_fsync_thread()
+{
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        std::lock_guard<std::mutex> lock(g_data.aof_fd_lock);
+        int fd = g_data.aof_fd;
+        if (fd >= 0 && g_data.aof_dirty.exchange(false))
+        {
+            fdatasync(fd);
+        }
+    }
+}
+
+static uint64_t get_monotonic_msec()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
+}
+
 static void fd_set_nb(int fd)
 {
     int flags = fcntl(fd, F_GETFL, 0);
@@ -138,6 +437,8 @@ static bool try_one_request(Conn *conn);
 static void state_req(Conn *conn);
 static void state_res(Conn *conn);
 static bool try_flush_buffer(Conn *conn);
+static size_t out_begin(Conn *conn);
+static void out_end(Conn *conn, size_t hdr);
 
 static int32_t accept_new_conn(std::vector<Conn *> &fd2conn, int fd)
 {
@@ -166,13 +467,24 @@ static int32_t accept_new_conn(std::vector<Conn *> &fd2conn, int fd)
     conn->fd = connfd;
     conn->state = STATE_REQ;
     conn->rbuf_size = 0;
-    conn->wbuf_size = 0;
     conn->wbuf_sent = 0;
 
     conn_put(fd2conn, conn); // Save the connection in the list
     return 0;
 }
 
+// Answer the requests read while a reply was pending or the client was
+// blocked, once the connection takes requests again
+static void conn_resume(Conn *conn)
+{
+    if (conn->state == STATE_REQ)
+    {
+        while (try_one_request(conn))
+        {
+        }
+    }
+}
+
 static void connection_io(Conn *conn)
 {
     if (!conn)
@@ -187,10 +499,11 @@ static void connection_io(Conn *conn)
     else if (conn->state == STATE_RES)
     {
         state_res(conn);
+        conn_resume(conn);
     }
-    else if (conn->state == STATE_END)
+    else if (conn->state == STATE_END || conn->state == STATE_BLOCK)
     {
-        // Handle connection cleanup
+        // Handle connection cleanup, or wait for the blocking command to be served
     }
     else
     {
@@ -256,12 +569,17 @@ static void out_nil(std::string &out)
     out.push_back(SER_NIL);
 }
 
-static void out_str(std::string &out, const std::string &val)
+static void out_str(std::string &out, const char *val, size_t size)
 {
     out.push_back(SER_STR);
-    uint32_t len = (uint32_t)val.size();
+    uint32_t len = (uint32_t)size;
     out.append((char *)&len, 4);
-    out.append(val);
+    out.append(val, size);
+}
+
+static void out_str(std::string &out, const std::string &val)
+{
+    out_str(out, val.data(), val.size());
 }
 
 static void out_int(std::string &out, int64_t val)
@@ -315,12 +633,6 @@ static void cb_scan(HNode *node, void *arg)
     out_str(out, container_of(node, Entry, node)->key);
 }
 
-size_t hm_size(const HMap *hmap)
-{
-    // Sum the sizes of the two hash tables
-    return hmap->ht1.size + hmap->ht2.size;
-}
-
 static bool entry_eq(HNode *lhs, HNode *rhs)
 {
     struct Entry *le = container_of(lhs, struct Entry, node);
@@ -348,14 +660,8 @@ static void do_del(std::vector<std::string> &cmd, std::string &out)
     if (node)
     {
         Entry *entry = container_of(node, Entry, node);
-        if (entry->type == T_ZSET)
-        {
-            delete (ZSetEntry *)entry;
-        }
-        else
-        {
-            delete (StrEntry *)entry;
-        }
+        entry_touch(entry);
+        entry_del(entry);
         out_int(out, 1);
     }
     else
@@ -366,6 +672,19 @@ static void do_del(std::vector<std::string> &cmd, std::string &out)
 
 static void do_get(std::vector<std::string> &cmd, std::string &out)
 {
+    if (g_data.dataset.data)
+    {
+        const char *val = nullptr;
+        uint32_t vlen = 0;
+        if (!ds_get(&g_data.dataset, cmd[1].data(), cmd[1].size(), &val, &vlen))
+        {
+            out_nil(out);
+            return;
+        }
+        out_str(out, val, vlen);
+        return;
+    }
+
     Entry key;
     key.key.swap(cmd[1]);
     key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
@@ -402,14 +721,8 @@ static void do_set(std::vector<std::string> &cmd, std::string &out)
         {
             // Remove the old entry of different type
             hm_pop(&g_data.db, &key.node, &entry_eq);
-            if (entry->type == T_ZSET)
-            {
-                delete (ZSetEntry *)entry;
-            }
-            else
-            {
-                delete (StrEntry *)entry;
-            }
+            entry_touch(entry);
+            entry_del(entry);
 
             // Create a new string entry
             StrEntry *new_entry = new StrEntry();
@@ -417,11 +730,13 @@ static void do_set(std::vector<std::string> &cmd, std::string &out)
             new_entry->node.hcode = key.node.hcode;
             new_entry->val.swap(cmd[2]);
             hm_insert(&g_data.db, &new_entry->node);
+            entry_touch(new_entry);
         }
         else
         {
             // Update existing string
             StrEntry *str_entry = (StrEntry *)entry;
+            entry_touch(str_entry);
             str_entry->val.swap(cmd[2]);
         }
     }
@@ -433,232 +748,1964 @@ static void do_set(std::vector<std::string> &cmd, std::string &out)
         new_entry->node.hcode = key.node.hcode;
         new_entry->val.swap(cmd[2]);
         hm_insert(&g_data.db, &new_entry->node);
+        entry_touch(new_entry);
     }
     out_str(out, "OK");
 }
 
 // ZSET Commands
 
-// ZADD key score member [score member ...]
-static void do_zadd(std::vector<std::string> &cmd, std::string &out)
+enum
+{
+    ZADD_NX = 1 << 0,   // only add new members
+    ZADD_XX = 1 << 1,   // only update existing members
+    ZADD_GT = 1 << 2,   // only update when the new score is greater
+    ZADD_LT = 1 << 3,   // only update when the new score is less
+    ZADD_INCR = 1 << 4, // add the score to the current one
+};
+
+static bool str2dbl(const std::string &s, double &out)
+{
+    char *endp = nullptr;
+    out = strtod(s.c_str(), &endp);
+    return !s.empty() && endp == s.c_str() + s.size() && !std::isnan(out);
+}
+
+static bool str2int(const std::string &s, int64_t &out)
+{
+    char *endp = nullptr;
+    errno = 0;
+    out = strtoll(s.c_str(), &endp, 10);
+    return !s.empty() && endp == s.c_str() + s.size() && errno == 0;
+}
+
+// Wake up clients waiting on this key once the event loop gets to them
+static void zset_signal(const std::string &key)
 {
-    if ((cmd.size() - 2) % 2 != 0)
+    if (g_data.waiters.count(key) &&
+        std::find(g_data.ready_keys.begin(), g_data.ready_keys.end(), key) == g_data.ready_keys.end())
     {
-        out_err(out, RES_ERR, "ZADD requires pairs of score and member");
-        return;
+        g_data.ready_keys.push_back(key);
     }
+}
 
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-
-    ZSetEntry *zset = nullptr;
+// Get the ZSET at key, creating it or replacing a value of another type
+static ZSetEntry *zset_upsert(Entry &key)
+{
     HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
     if (node)
     {
         Entry *entry = container_of(node, Entry, node);
-        if (entry->type != T_ZSET)
+        if (entry->type == T_ZSET)
         {
-            // Replace existing entry with a new ZSET
-            hm_pop(&g_data.db, &key.node, &entry_eq);
-            if (entry->type == T_STR)
-            {
-                delete (StrEntry *)entry;
-            }
-            else
-            {
-                delete entry;
-            }
-
-            zset = new ZSetEntry();
-            zset->key.swap(key.key);
-            zset->node.hcode = key.node.hcode;
-            hm_insert(&g_data.db, &zset->node);
+            entry_touch(entry);
+            return (ZSetEntry *)entry;
         }
-        else
+
+        // Replace existing entry with a new ZSET
+        hm_pop(&g_data.db, &key.node, &entry_eq);
+        entry_touch(entry);
+        entry_del(entry);
+    }
+
+    ZSetEntry *zset = new ZSetEntry();
+    zset->zset.pool = zset_pool();
+    zset->key.swap(key.key);
+    zset->node.hcode = key.node.hcode;
+    hm_insert(&g_data.db, &zset->node);
+    entry_touch(zset);
+    return zset;
+}
+
+// Add or update one member under the ZADD flags.
+// Returns 1 if applied (with the resulting score in *score), 0 if the flags
+// ruled it out, -1 if an increment produced NaN.
+static int32_t zadd_member(Zset *zset, const std::string &member, double *score, uint32_t flags, int64_t *added)
+{
+    Znode *znode = zset_lookup(zset, member.data(), member.size());
+    if (!znode)
+    {
+        if (flags & ZADD_XX)
         {
-            zset = (ZSetEntry *)entry;
+            return 0;
         }
+        zset_add(zset, member.data(), member.size(), *score);
+        (*added)++;
+        return 1;
     }
-    else
+    if (flags & ZADD_NX)
     {
-        // Create new ZSET
-        zset = new ZSetEntry();
-        zset->key.swap(key.key);
-        zset->node.hcode = key.node.hcode;
-        hm_insert(&g_data.db, &zset->node);
+        return 0;
     }
 
-    int64_t added = 0;
-    // Process score-member pairs
-    for (size_t i = 2; i < cmd.size(); i += 2)
+    double oldscore = znode_score(zset, znode);
+    double newscore = (flags & ZADD_INCR) ? oldscore + *score : *score;
+    if (std::isnan(newscore))
     {
-        double score = std::stod(cmd[i]);
-        const std::string &member = cmd[i + 1];
-        if (zset_add(&zset->zset, member.data(), member.size(), score))
-        {
-            added++;
-        }
+        return -1;
     }
-
-    out_int(out, added);
+    if (((flags & ZADD_GT) && !(newscore > oldscore)) ||
+        ((flags & ZADD_LT) && !(newscore < oldscore)))
+    {
+        return 0;
+    }
+    zset_update(zset, znode, newscore);
+    *score = newscore;
+    return 1;
 }
 
-// ZSCORE key member
-static void do_zscore(std::vector<std::string> &cmd, std::string &out)
+// ZADD key [NX|XX] [GT|LT] [INCR] score member [score member ...]
+static void do_zadd(std::vector<std::string> &cmd, std::string &out)
 {
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    uint32_t flags = 0;
+    size_t pos = 2;
+    for (; pos < cmd.size(); ++pos)
+    {
+        std::string opt = cmd[pos];
+        std::transform(opt.begin(), opt.end(), opt.begin(), ::tolower);
+        if (opt == "nx")
+            flags |= ZADD_NX;
+        else if (opt == "xx")
+            flags |= ZADD_XX;
+        else if (opt == "gt")
+            flags |= ZADD_GT;
+        else if (opt == "lt")
+            flags |= ZADD_LT;
+        else if (opt == "incr")
+            flags |= ZADD_INCR;
+        else
+            break;
+    }
 
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!node)
+    if (pos == cmd.size() || (cmd.size() - pos) % 2 != 0)
     {
-        out_nil(out);
+        out_err(out, RES_ERR, "ZADD requires pairs of score and member");
         return;
     }
-
-    Entry *entry = container_of(node, Entry, node);
-    if (entry->type != T_ZSET)
+    if ((flags & ZADD_NX) && (flags & (ZADD_XX | ZADD_GT | ZADD_LT)))
     {
-        out_err(out, RES_ERR, "Expecting ZSET type");
+        out_err(out, RES_ERR, "NX is not compatible with XX, GT or LT");
         return;
     }
-
-    ZSetEntry *zset = (ZSetEntry *)entry;
-    const std::string &member = cmd[2];
-    Znode *znode = zset_lookup(&zset->zset, member.data(), member.size());
-
-    if (znode)
+    if ((flags & ZADD_GT) && (flags & ZADD_LT))
     {
-        out_dbl(out, znode->score);
+        out_err(out, RES_ERR, "GT and LT are not compatible");
+        return;
     }
-    else
+    if ((flags & ZADD_INCR) && cmd.size() - pos != 2)
     {
-        out_nil(out);
+        out_err(out, RES_ERR, "INCR takes a single score-member pair");
+        return;
+    }
+
+    // Validate every score before touching the keyspace
+    std::vector<double> scores;
+    for (size_t i = pos; i < cmd.size(); i += 2)
+    {
+        double score = 0;
+        if (!str2dbl(cmd[i], score))
+        {
+            out_err(out, RES_ERR, "Score is not a valid float");
+            return;
+        }
+        scores.push_back(score);
     }
-}
 
-// ZRANGE key start stop [WITHSCORES]
-static void do_zrange(std::vector<std::string> &cmd, std::string &out)
-{
     Entry key;
     key.key.swap(cmd[1]);
     key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
 
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!node)
+    HNode *node = (flags & ZADD_XX) ? hm_lookup(&g_data.db, &key.node, &entry_eq) : NULL;
+    if ((flags & ZADD_XX) && (!node || container_of(node, Entry, node)->type != T_ZSET))
     {
-        out_arr(out, 0);
+        // Nothing can be updated: do not create the key, nor replace a
+        // value of another type with an empty set
+        if (flags & ZADD_INCR)
+            out_nil(out);
+        else
+            out_int(out, 0);
         return;
     }
+    ZSetEntry *zset = zset_upsert(key);
+    zset_signal(zset->key);
 
-    Entry *entry = container_of(node, Entry, node);
-    if (entry->type != T_ZSET)
+    int64_t added = 0;
+    if (flags & ZADD_INCR)
     {
-        out_err(out, RES_ERR, "Expecting ZSET type");
+        double score = scores[0];
+        int32_t rv = zadd_member(&zset->zset, cmd[pos + 1], &score, flags, &added);
+        if (rv < 0)
+            out_err(out, RES_ERR, "Resulting score is not a number (NaN)");
+        else if (rv == 0)
+            out_nil(out);
+        else
+            out_dbl(out, score);
         return;
     }
 
-    ZSetEntry *zset = (ZSetEntry *)entry;
+    if (!flags && !zset_size(&zset->zset))
+    {
+        // Empty set: hash every member first, then build the tree in one pass
+        zset_reserve(&zset->zset, scores.size());
+        for (size_t i = 0; i < scores.size(); ++i)
+        {
+            const std::string &member = cmd[pos + 2 * i + 1];
+            if (zset_bulk_add(&zset->zset, member.data(), member.size(), scores[i]))
+            {
+                added++;
+            }
+        }
+        zset_bulk_build(&zset->zset);
+        out_int(out, added);
+        return;
+    }
 
-    int64_t start = std::stoll(cmd[2]);
-    int64_t stop = std::stoll(cmd[3]);
+    // Process score-member pairs
+    for (size_t i = 0; i < scores.size(); ++i)
+    {
+        zadd_member(&zset->zset, cmd[pos + 2 * i + 1], &scores[i], flags, &added);
+    }
 
-    // Check for WITHSCORES option
-    bool withscores = (cmd.size() > 4 && cmd[4] == "WITHSCORES");
+    out_int(out, added);
+}
 
-    // Get the size of the sorted set
-    int64_t size = 0;
-    if (zset->zset.tree)
+// ZINCRBY key increment member
+static void do_zincrby(std::vector<std::string> &cmd, std::string &out)
+{
+    double score = 0;
+    if (!str2dbl(cmd[2], score))
     {
-        size = zset->zset.tree->cnt;
+        out_err(out, RES_ERR, "Increment is not a valid float");
+        return;
     }
 
-    // Handle negative indices (relative to the end)
-    if (start < 0)
-        start = size + start;
-    if (stop < 0)
-        stop = size + stop;
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    ZSetEntry *zset = zset_upsert(key);
+    zset_signal(zset->key);
+    int64_t added = 0;
+    if (zadd_member(&zset->zset, cmd[3], &score, ZADD_INCR, &added) < 0)
+    {
+        out_err(out, RES_ERR, "Resulting score is not a number (NaN)");
+        return;
+    }
+    out_dbl(out, score);
+}
+
+enum
+{
+    ZOP_UNION = 0,
+    ZOP_INTER = 1,
+    ZOP_DIFF = 2,
+};
+
+enum
+{
+    AGG_SUM = 0,
+    AGG_MIN = 1,
+    AGG_MAX = 2,
+};
+
+static double zagg(double acc, double val, int agg)
+{
+    double rv = val;
+    if (agg == AGG_SUM)
+        rv = acc + val;
+    else if (agg == AGG_MIN)
+        rv = std::min(acc, val);
+    else if (agg == AGG_MAX)
+        rv = std::max(acc, val);
+    return std::isnan(rv) ? 0 : rv; // inf + -inf
+}
+
+static double zweigh(double score, double weight)
+{
+    double rv = score * weight;
+    return std::isnan(rv) ? 0 : rv; // inf * 0
+}
+
+// Compute the union, intersection or difference of the inputs into the empty set dst.
+// Members are accumulated in dst's hashtable and the tree is built once at the end.
+static void zset_combine(Zset *dst, std::vector<Zset *> &srcs, std::vector<double> &weights, int op, int agg)
+{
+    if (op == ZOP_UNION)
+    {
+        size_t total = 0;
+        for (Zset *src : srcs)
+        {
+            total += src ? zset_size(src) : 0;
+        }
+        zset_reserve(dst, total);
+        for (size_t i = 0; i < srcs.size(); ++i)
+        {
+            for (Znode *z = srcs[i] ? zset_first(srcs[i]) : nullptr; z; z = znode_next(srcs[i], z))
+            {
+                ZMember member;
+                znode_member(srcs[i], z, &member);
+                double score = zweigh(znode_score(srcs[i], z), weights[i]);
+                Znode *acc = zset_lookup(dst, member.name, member.len);
+                if (acc)
+                {
+                    score = zagg(znode_score(dst, acc), score, agg);
+                }
+                zset_bulk_add(dst, member.name, member.len, score);
+            }
+        }
+    }
+    else if (op == ZOP_INTER)
+    {
+        // Iterate the smallest input and probe the others
+        size_t small = 0;
+        for (size_t i = 0; i < srcs.size(); ++i)
+        {
+            if (!srcs[i])
+            {
+                return; // an empty input empties the intersection
+            }
+            if (zset_size(srcs[i]) < zset_size(srcs[small]))
+            {
+                small = i;
+            }
+        }
+        zset_reserve(dst, zset_size(srcs[small]));
+        for (Znode *z = zset_first(srcs[small]); z; z = znode_next(srcs[small], z))
+        {
+            ZMember member;
+            znode_member(srcs[small], z, &member);
+            double score = zweigh(znode_score(srcs[small], z), weights[small]);
+            size_t i = 0;
+            for (; i < srcs.size(); ++i)
+            {
+                if (i == small)
+                {
+                    continue;
+                }
+                Znode *other = zset_lookup(srcs[i], member.name, member.len);
+                if (!other)
+                {
+                    break;
+                }
+                score = zagg(score, zweigh(znode_score(srcs[i], other), weights[i]), agg);
+            }
+            if (i == srcs.size())
+            {
+                zset_bulk_add(dst, member.name, member.len, score);
+            }
+        }
+    }
+    else
+    {
+        if (!srcs[0])
+        {
+            return;
+        }
+        zset_reserve(dst, zset_size(srcs[0]));
+        for (Znode *z = zset_first(srcs[0]); z; z = znode_next(srcs[0], z))
+        {
+            ZMember member;
+            znode_member(srcs[0], z, &member);
+            size_t i = 1;
+            while (i < srcs.size() && !(srcs[i] && zset_lookup(srcs[i], member.name, member.len)))
+            {
+                ++i;
+            }
+            if (i == srcs.size())
+            {
+                zset_bulk_add(dst, member.name, member.len, znode_score(srcs[0], z));
+            }
+        }
+    }
+    zset_bulk_build(dst);
+}
+
+// ZUNIONSTORE|ZINTERSTORE dest numkeys key [key ...] [WEIGHTS weight ...] [AGGREGATE SUM|MIN|MAX]
+// ZDIFFSTORE dest numkeys key [key ...]
+static void do_zsetop(std::vector<std::string> &cmd, std::string &out, int op)
+{
+    int64_t numkeys = 0;
+    if (!str2int(cmd[2], numkeys) || numkeys < 1 || (size_t)numkeys > cmd.size() - 3)
+    {
+        out_err(out, RES_ERR, "Invalid number of keys");
+        return;
+    }
+
+    std::vector<double> weights((size_t)numkeys, 1.0);
+    int agg = AGG_SUM;
+    size_t pos = 3 + (size_t)numkeys;
+    while (pos < cmd.size())
+    {
+        std::string opt = cmd[pos];
+        std::transform(opt.begin(), opt.end(), opt.begin(), ::tolower);
+        if (op != ZOP_DIFF && opt == "weights" && pos + numkeys < cmd.size())
+        {
+            for (size_t i = 0; i < weights.size(); ++i)
+            {
+                if (!str2dbl(cmd[pos + 1 + i], weights[i]))
+                {
+                    out_err(out, RES_ERR, "Weight is not a valid float");
+                    return;
+                }
+            }
+            pos += 1 + (size_t)numkeys;
+        }
+        else if (op != ZOP_DIFF && opt == "aggregate" && pos + 1 < cmd.size())
+        {
+            std::string name = cmd[pos + 1];
+            std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+            if (name == "sum")
+                agg = AGG_SUM;
+            else if (name == "min")
+                agg = AGG_MIN;
+            else if (name == "max")
+                agg = AGG_MAX;
+            else
+            {
+                out_err(out, RES_ERR, "AGGREGATE must be SUM, MIN or MAX");
+                return;
+            }
+            pos += 2;
+        }
+        else
+        {
+            out_err(out, RES_ERR, "Syntax error");
+            return;
+        }
+    }
+
+    // Missing keys read as empty sets
+    std::vector<Zset *> srcs;
+    for (size_t i = 0; i < (size_t)numkeys; ++i)
+    {
+        Entry key;
+        key.key.swap(cmd[3 + i]);
+        key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+        HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+        Entry *entry = node ? container_of(node, Entry, node) : nullptr;
+        if (entry && entry->type != T_ZSET)
+        {
+            out_err(out, RES_ERR, "Expecting ZSET type");
+            return;
+        }
+        srcs.push_back(entry ? &((ZSetEntry *)entry)->zset : nullptr);
+    }
+
+    // The destination may be one of the inputs, so it is replaced only now
+    Zset result;
+    result.pool = zset_pool();
+    zset_combine(&result, srcs, weights, op, agg);
+
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *old = hm_pop(&g_data.db, &key.node, &entry_eq);
+    if (old)
+    {
+        entry_touch(container_of(old, Entry, node));
+        entry_del(container_of(old, Entry, node));
+    }
+
+    int64_t size = (int64_t)zset_size(&result);
+    if (size > 0)
+    {
+        ZSetEntry *zset = new ZSetEntry();
+        zset->key.swap(key.key);
+        zset->node.hcode = key.node.hcode;
+        zset->zset = result;
+        hm_insert(&g_data.db, &zset->node);
+        entry_touch(zset);
+        zset_signal(zset->key);
+    }
+    else
+    {
+        zset_dispose(&result);
+    }
+    out_int(out, size);
+}
+
+// Look up an entry without consuming the key string
+static Entry *entry_find(const std::string &name)
+{
+    Entry key;
+    key.key = name;
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    return node ? container_of(node, Entry, node) : nullptr;
+}
+
+// Remove a ZSET key once its last member is gone
+static void zset_drop_if_empty(ZSetEntry *zset)
+{
+    if (zset_size(&zset->zset))
+    {
+        return;
+    }
+    HNode *node = hm_pop(&g_data.db, &zset->node, &entry_eq);
+    assert(node == &zset->node);
+    (void)node;
+    entry_del(zset);
+}
+
+// Output the name of a member
+static void out_member(std::string &out, Zset *zset, Znode *znode)
+{
+    ZMember member;
+    znode_member(zset, znode, &member);
+    out_str(out, member.name, member.len);
+}
+
+// Detach the lowest or highest member and output it as member, score
+static bool zpop_one(Zset *zset, bool max, std::string &out)
+{
+    Znode *znode = max ? zset_last(zset) : zset_first(zset);
+    if (!znode)
+    {
+        return false;
+    }
+    out_member(out, zset, znode);
+    out_dbl(out, znode_score(zset, znode));
+    zset_delete(zset, znode);
+    return true;
+}
+
+// ZPOPMIN|ZPOPMAX key [count]
+static void do_zpop(std::vector<std::string> &cmd, std::string &out, bool max)
+{
+    int64_t count = 1;
+    if (cmd.size() == 3 && (!str2int(cmd[2], count) || count < 0))
+    {
+        out_err(out, RES_ERR, "Count must be a non-negative integer");
+        return;
+    }
+
+    Entry *entry = entry_find(cmd[1]);
+    if (!entry)
+    {
+        out_arr(out, 0);
+        return;
+    }
+    if (entry->type != T_ZSET)
+    {
+        out_err(out, RES_ERR, "Expecting ZSET type");
+        return;
+    }
+
+    ZSetEntry *zset = (ZSetEntry *)entry;
+    entry_touch(zset);
+    int64_t n = std::min(count, (int64_t)zset_size(&zset->zset));
+    out_arr(out, (uint32_t)(2 * n));
+    for (int64_t i = 0; i < n; ++i)
+    {
+        zpop_one(&zset->zset, max, out);
+    }
+    zset_drop_if_empty(zset);
+}
+
+// BZPOPMIN|BZPOPMAX key [key ...] timeout
+static void do_bzpop(Conn *conn, std::vector<std::string> &cmd, std::string &out, bool max)
+{
+    double timeout = 0;
+    if (!str2dbl(cmd.back(), timeout) || timeout < 0)
+    {
+        out_err(out, RES_ERR, "Timeout must be a non-negative number of seconds");
+        return;
+    }
+
+    // Serve right away from the first non-empty key
+    for (size_t i = 1; i + 1 < cmd.size(); ++i)
+    {
+        Entry *entry = entry_find(cmd[i]);
+        if (entry && entry->type != T_ZSET)
+        {
+            out_err(out, RES_ERR, "Expecting ZSET type");
+            return;
+        }
+        if (entry && zset_size(&((ZSetEntry *)entry)->zset))
+        {
+            ZSetEntry *zset = (ZSetEntry *)entry;
+            out_arr(out, 3);
+            out_str(out, cmd[i]);
+            entry_touch(zset);
+            zpop_one(&zset->zset, max, out);
+            zset_drop_if_empty(zset);
+            aof_append({max ? "zpopmax" : "zpopmin", cmd[i]});
+            return;
+        }
+    }
+
+    if (!conn)
+    {
+        out_nil(out);
+        return;
+    }
+
+    // Park the client until a key gets a member or the timeout expires
+    conn->state = STATE_BLOCK;
+    conn->block_max = max;
+    conn->block_deadline_ms = timeout > 0 ? get_monotonic_msec() + (uint64_t)(timeout * 1000) : 0;
+    for (size_t i = 1; i + 1 < cmd.size(); ++i)
+    {
+        if (std::find(conn->blocked_keys.begin(), conn->blocked_keys.end(), cmd[i]) == conn->blocked_keys.end())
+        {
+            conn->blocked_keys.push_back(cmd[i]);
+            g_data.waiters[cmd[i]].push_back(conn);
+        }
+    }
+}
+
+static void conn_unblock(Conn *conn)
+{
+    for (const std::string &key : conn->blocked_keys)
+    {
+        auto it = g_data.waiters.find(key);
+        if (it == g_data.waiters.end())
+        {
+            continue;
+        }
+        std::deque<Conn *> &queue = it->second;
+        queue.erase(std::remove(queue.begin(), queue.end(), conn), queue.end());
+        if (queue.empty())
+        {
+            g_data.waiters.erase(it);
+        }
+    }
+    conn->blocked_keys.clear();
+    conn->block_deadline_ms = 0;
+}
+
+// Hand members of the keys that got new data to the clients waiting on them
+static void serve_blocked()
+{
+    std::vector<std::string> ready;
+    ready.swap(g_data.ready_keys);
+    for (const std::string &key : ready)
+    {
+        while (true)
+        {
+            auto it = g_data.waiters.find(key);
+            Entry *entry = entry_find(key);
+            if (it == g_data.waiters.end() || !entry || entry->type != T_ZSET ||
+                !zset_size(&((ZSetEntry *)entry)->zset))
+            {
+                break;
+            }
+
+            Conn *conn = it->second.front();
+            ZSetEntry *zset = (ZSetEntry *)entry;
+            size_t hdr = out_begin(conn);
+            out_arr(conn->wbuf, 3);
+            out_str(conn->wbuf, key);
+            entry_touch(zset);
+            zpop_one(&zset->zset, conn->block_max, conn->wbuf);
+            zset_drop_if_empty(zset);
+            aof_append({conn->block_max ? "zpopmax" : "zpopmin", key});
+
+            conn_unblock(conn);
+            out_end(conn, hdr);
+            conn_resume(conn);
+        }
+    }
+}
+
+// Reply nil to blocked clients whose timeout has expired,
+// returns the poll() timeout until the next deadline
+static int process_timers(std::vector<Conn *> &fd2conn)
+{
+    uint64_t now = get_monotonic_msec();
+    uint64_t next = now + 1000;
+    for (Conn *conn : fd2conn)
+    {
+        if (!conn || conn->state != STATE_BLOCK || !conn->block_deadline_ms)
+        {
+            continue;
+        }
+        if (conn->block_deadline_ms <= now)
+        {
+            conn_unblock(conn);
+            size_t hdr = out_begin(conn);
+            out_nil(conn->wbuf);
+            out_end(conn, hdr);
+            conn_resume(conn);
+        }
+        else
+        {
+            next = std::min(next, conn->block_deadline_ms);
+        }
+    }
+    return (int)(next - now);
+}
+
+// ZREM key member [member ...]
+static void do_zrem(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *entry = entry_find(cmd[1]);
+    if (!entry)
+    {
+        out_int(out, 0);
+        return;
+    }
+    if (entry->type != T_ZSET)
+    {
+        out_err(out, RES_ERR, "Expecting ZSET type");
+        return;
+    }
+
+    ZSetEntry *zset = (ZSetEntry *)entry;
+    int64_t removed = 0;
+    for (size_t i = 2; i < cmd.size(); ++i)
+    {
+        Znode *znode = zset_lookup(&zset->zset, cmd[i].data(), cmd[i].size());
+        if (znode)
+        {
+            if (!removed)
+            {
+                entry_touch(zset);
+            }
+            zset_delete(&zset->zset, znode);
+            removed++;
+        }
+    }
+    zset_drop_if_empty(zset);
+    out_int(out, removed);
+}
+
+// ZSCORE key member
+static void do_zscore(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    if (!node)
+    {
+        out_nil(out);
+        return;
+    }
+
+    Entry *entry = container_of(node, Entry, node);
+    if (entry->type != T_ZSET)
+    {
+        out_err(out, RES_ERR, "Expecting ZSET type");
+        return;
+    }
+
+    ZSetEntry *zset = (ZSetEntry *)entry;
+    const std::string &member = cmd[2];
+    Znode *znode = zset_lookup(&zset->zset, member.data(), member.size());
+
+    if (znode)
+    {
+        out_dbl(out, znode_score(&zset->zset, znode));
+    }
+    else
+    {
+        out_nil(out);
+    }
+}
+
+// Resolve negative rank indices and clamp them to the set, false if the range is empty
+static bool zrange_clamp(int64_t &start, int64_t &stop, int64_t size)
+{
+    // Handle negative indices (relative to the end)
+    if (start < 0)
+        start = size + start;
+    if (stop < 0)
+        stop = size + stop;
 
     // Boundary checks
     if (start < 0)
         start = 0;
     if (stop >= size)
         stop = size - 1;
-    if (start > stop || start >= size)
+    return start <= stop && start < size;
+}
+
+// Parse a score bound: a float, -inf/+inf, or '(' followed by either for an exclusive bound
+static bool str2bound(const std::string &s, double &out, bool &inclusive)
+{
+    inclusive = s.empty() || s[0] != '(';
+    return str2dbl(inclusive ? s : s.substr(1), out);
+}
+
+// Output count, sum, min and max of the scores ranked [lo, hi]
+static void out_zsum(Zset *zset, int64_t lo, int64_t hi, std::string &out)
+{
+    out_arr(out, 4);
+    if (lo > hi)
+    {
+        out_int(out, 0);
+        out_dbl(out, 0);
+        out_nil(out);
+        out_nil(out);
+        return;
+    }
+    // the set is sorted, so min and max are the boundary members
+    out_int(out, hi - lo + 1);
+    out_dbl(out, zset_sum_rank(zset, lo, hi));
+    out_dbl(out, znode_score(zset, zset_at(zset, lo)));
+    out_dbl(out, znode_score(zset, zset_at(zset, hi)));
+}
+
+// ZSUMRANGE key start stop
+// ZSUMRANGEBYSCORE key min max
+static void do_zsumrange(std::vector<std::string> &cmd, std::string &out, bool byscore)
+{
+    Entry *entry = entry_find(cmd[1]);
+    if (entry && entry->type != T_ZSET)
+    {
+        out_err(out, RES_ERR, "Expecting ZSET type");
+        return;
+    }
+    Zset empty;
+    Zset *zset = entry ? &((ZSetEntry *)entry)->zset : &empty;
+    int64_t size = zset_size(zset);
+
+    if (!byscore)
+    {
+        int64_t start = 0, stop = 0;
+        if (!str2int(cmd[2], start) || !str2int(cmd[3], stop))
+        {
+            out_err(out, RES_ERR, "Start and stop must be integers");
+            return;
+        }
+        if (!zrange_clamp(start, stop, size))
+        {
+            start = 0, stop = -1;
+        }
+        out_zsum(zset, start, stop, out);
+        return;
+    }
+
+    double min = 0, max = 0;
+    bool min_incl = true, max_incl = true;
+    if (!str2bound(cmd[2], min, min_incl) || !str2bound(cmd[3], max, max_incl))
+    {
+        out_err(out, RES_ERR, "Min and max must be floats");
+        return;
+    }
+    // [first, end) are the members within the bounds
+    Znode *first = zset_seek_score(zset, min, min_incl);
+    Znode *end = zset_seek_score(zset, max, !max_incl);
+    int64_t lo = first ? zset_rank(zset, first) : size;
+    int64_t hi = (end ? zset_rank(zset, end) : size) - 1;
+    out_zsum(zset, lo, hi, out);
+}
+
+// ZRANGE key start stop [WITHSCORES]
+// ZREVRANGE key start stop [WITHSCORES]
+// The slot holding this query, or the one to overwrite: a stale one, else the oldest
+static ZRangeCached *zrange_cache_slot(ZSetEntry *zset, int64_t start, int64_t stop,
+                                       bool reverse, bool withscores)
+{
+    std::vector<ZRangeCached> &cache = zset->zrange_cache;
+    ZRangeCached *victim = nullptr;
+    for (ZRangeCached &c : cache)
+    {
+        if (c.start == start && c.stop == stop && c.reverse == reverse && c.withscores == withscores)
+        {
+            return &c;
+        }
+        if (!victim && c.version != zset->zset.version)
+        {
+            victim = &c;
+        }
+    }
+    if (victim)
+    {
+        victim->resp.clear();
+        return victim;
+    }
+    if (cache.size() < k_zrange_cache_slots)
+    {
+        cache.emplace_back();
+        return &cache.back();
+    }
+    std::rotate(cache.begin(), cache.begin() + 1, cache.end());
+    cache.back().resp.clear();
+    return &cache.back();
+}
+
+static void do_zrange(std::vector<std::string> &cmd, std::string &out, bool reverse)
+{
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    if (!node)
+    {
+        out_arr(out, 0);
+        return;
+    }
+
+    Entry *entry = container_of(node, Entry, node);
+    if (entry->type != T_ZSET)
+    {
+        out_err(out, RES_ERR, "Expecting ZSET type");
+        return;
+    }
+
+    ZSetEntry *zset = (ZSetEntry *)entry;
+
+    int64_t start = 0, stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop))
+    {
+        out_err(out, RES_ERR, "Start and stop must be integers");
+        return;
+    }
+
+    // Check for WITHSCORES option
+    bool withscores = (cmd.size() > 4 && strcasecmp(cmd[4].c_str(), "WITHSCORES") == 0);
+
+    if (!zrange_clamp(start, stop, zset_size(&zset->zset)))
+    {
+        out_arr(out, 0);
+        return;
+    }
+
+    ZRangeCached *slot = nullptr;
+    if (g_data.zrange_cache)
+    {
+        slot = zrange_cache_slot(zset, start, stop, reverse, withscores);
+        if (slot->version == zset->zset.version && !slot->resp.empty())
+        {
+            out.append(slot->resp);
+            return;
+        }
+    }
+
+    size_t pos = out.size();
+    int64_t count = stop - start + 1;
+    out_arr(out, withscores ? count * 2 : count);
+
+    // Members are copied straight from the nodes into the output buffer
+    ZIter iter = zset_iter(&zset->zset, start, reverse);
+    for (int64_t i = 0; i < count; ++i)
+    {
+        Znode *z = ziter_next(&iter);
+        out_member(out, &zset->zset, z);
+        if (withscores)
+        {
+            out_dbl(out, znode_score(&zset->zset, z));
+        }
+    }
+
+    if (slot && out.size() - pos <= k_zrange_cache_max)
+    {
+        slot->start = start;
+        slot->stop = stop;
+        slot->reverse = reverse;
+        slot->withscores = withscores;
+        slot->version = zset->zset.version;
+        slot->resp.assign(out, pos, std::string::npos);
+    }
+}
+
+// Page cursors encode the last (score, member) returned, in hex so that they
+// survive the CLI: 16 digits of the score bits followed by the member bytes.
+static std::string zcursor_encode(Zset *zset, Znode *znode)
+{
+    static const char hex[] = "0123456789abcdef";
+    double score = znode_score(zset, znode);
+    uint64_t bits = 0;
+    memcpy(&bits, &score, 8);
+    std::string cursor;
+    for (int shift = 60; shift >= 0; shift -= 4)
+    {
+        cursor.push_back(hex[(bits >> shift) & 15]);
+    }
+    ZMember member;
+    znode_member(zset, znode, &member);
+    for (size_t i = 0; i < member.len; ++i)
+    {
+        uint8_t c = (uint8_t)member.name[i];
+        cursor.push_back(hex[c >> 4]);
+        cursor.push_back(hex[c & 15]);
+    }
+    return cursor;
+}
+
+// Whether a member is named name
+static bool zmember_is(Zset *zset, Znode *znode, const std::string &name)
+{
+    ZMember member;
+    znode_member(zset, znode, &member);
+    return member.len == name.size() && memcmp(member.name, name.data(), name.size()) == 0;
+}
+
+static bool zcursor_decode(const std::string &cursor, double &score, std::string &name)
+{
+    if (cursor.size() < 16 || cursor.size() % 2 != 0)
+    {
+        return false;
+    }
+    uint64_t bits = 0;
+    name.clear();
+    for (size_t i = 0; i < cursor.size(); ++i)
+    {
+        char c = cursor[i];
+        int v = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+        if (v < 0)
+        {
+            return false;
+        }
+        if (i < 16)
+            bits = (bits << 4) | (uint64_t)v;
+        else if (i % 2 == 0)
+            name.push_back((char)(v << 4));
+        else
+            name.back() |= (char)v;
+    }
+    memcpy(&score, &bits, 8);
+    return !std::isnan(score);
+}
+
+// ZRANGEPAGE key cursor count [WITHSCORES] [REV]
+// Returns [next cursor, members]. Start with cursor "0", the last page returns "0".
+// Each page is one seek plus the page itself, and stays consistent under inserts.
+static void do_zrangepage(std::vector<std::string> &cmd, std::string &out)
+{
+    int64_t count = 0;
+    if (!str2int(cmd[3], count) || count <= 0)
+    {
+        out_err(out, RES_ERR, "Count must be a positive integer");
+        return;
+    }
+    bool withscores = false;
+    bool reverse = false;
+    for (size_t i = 4; i < cmd.size(); ++i)
+    {
+        if (strcasecmp(cmd[i].c_str(), "WITHSCORES") == 0)
+            withscores = true;
+        else if (strcasecmp(cmd[i].c_str(), "REV") == 0)
+            reverse = true;
+        else
+        {
+            out_err(out, RES_ERR, "Syntax error");
+            return;
+        }
+    }
+
+    double score = 0;
+    std::string name;
+    bool resume = (cmd[2] != "0");
+    if (resume && !zcursor_decode(cmd[2], score, name))
+    {
+        out_err(out, RES_ERR, "Invalid cursor");
+        return;
+    }
+
+    Entry *entry = entry_find(cmd[1]);
+    if (entry && entry->type != T_ZSET)
+    {
+        out_err(out, RES_ERR, "Expecting ZSET type");
+        return;
+    }
+    Zset empty;
+    Zset *zset = entry ? &((ZSetEntry *)entry)->zset : &empty;
+
+    // Seek past the last member returned, even if it was removed since
+    ZIter iter;
+    iter.zset = zset;
+    iter.reverse = reverse;
+    if (!resume)
+    {
+        iter.node = reverse ? zset_last(zset) : zset_first(zset);
+    }
+    else
+    {
+        Znode *ge = zset_query(zset, score, name.data(), name.size(), 0);
+        if (reverse)
+            iter.node = ge ? znode_prev(zset, ge) : zset_last(zset);
+        else if (ge && znode_score(zset, ge) == score && zmember_is(zset, ge, name))
+            iter.node = znode_next(zset, ge);
+        else
+            iter.node = ge;
+    }
+
+    // Count the page first, the array length precedes the members
+    ZIter probe = iter;
+    int64_t n = 0;
+    Znode *last = nullptr;
+    while (n < count && (last = ziter_next(&probe)))
+    {
+        n++;
+    }
+    if (n < count)
+    {
+        last = nullptr;
+    }
+    else if (!probe.node)
+    {
+        last = nullptr; // the page ends exactly at the end of the set
+    }
+
+    out_arr(out, 2);
+    out_str(out, last ? zcursor_encode(zset, last) : std::string("0"));
+    out_arr(out, (uint32_t)(withscores ? n * 2 : n));
+    for (int64_t i = 0; i < n; ++i)
+    {
+        Znode *z = ziter_next(&iter);
+        out_member(out, zset, z);
+        if (withscores)
+        {
+            out_dbl(out, znode_score(zset, z));
+        }
+    }
+}
+
+static std::mt19937_64 &zrand()
+{
+    static std::mt19937_64 rng(std::random_device{}());
+    return rng;
+}
+
+// ZRANDMEMBER key [count [WITHSCORES]]
+// A positive count returns distinct members, a negative one allows repeats.
+// Ranks are drawn first and each is resolved with one zset_at() descent.
+static void do_zrandmember(std::vector<std::string> &cmd, std::string &out)
+{
+    int64_t count = 1;
+    bool single = (cmd.size() == 2);
+    if (!single && !str2int(cmd[2], count))
+    {
+        out_err(out, RES_ERR, "Count must be an integer");
+        return;
+    }
+    bool withscores = false;
+    if (cmd.size() == 4)
+    {
+        if (strcasecmp(cmd[3].c_str(), "WITHSCORES") != 0)
+        {
+            out_err(out, RES_ERR, "Syntax error");
+            return;
+        }
+        withscores = true;
+    }
+
+    Entry *entry = entry_find(cmd[1]);
+    if (entry && entry->type != T_ZSET)
+    {
+        out_err(out, RES_ERR, "Expecting ZSET type");
+        return;
+    }
+    Zset *zset = entry ? &((ZSetEntry *)entry)->zset : nullptr;
+    int64_t n = zset ? (int64_t)zset_size(zset) : 0;
+    if (single)
+    {
+        if (n == 0)
+            out_nil(out);
+        else
+        {
+            Znode *z = zset_at(zset, (int64_t)(zrand()() % (uint64_t)n));
+            out_member(out, zset, z);
+        }
+        return;
+    }
+
+    std::vector<int64_t> ranks;
+    if (n > 0 && count < 0)
+    {
+        std::uniform_int_distribution<int64_t> pick(0, n - 1);
+        int64_t k = (count == INT64_MIN) ? INT64_MAX : -count;
+        if ((uint64_t)k > k_max_resp / 16)
+        {
+            out_err(out, RES_ERR, "Count is too large");
+            return;
+        }
+        ranks.resize((size_t)k);
+        for (int64_t &r : ranks)
+        {
+            r = pick(zrand());
+        }
+    }
+    else if (n > 0 && count > 0)
+    {
+        // Floyd's sampling: k distinct ranks out of n in O(k) draws
+        int64_t k = std::min(count, n);
+        std::unordered_set<int64_t> seen;
+        seen.reserve((size_t)k);
+        for (int64_t j = n - k; j < n; ++j)
+        {
+            int64_t r = std::uniform_int_distribution<int64_t>(0, j)(zrand());
+            if (!seen.insert(r).second)
+            {
+                seen.insert(j);
+                r = j;
+            }
+            ranks.push_back(r);
+        }
+        std::shuffle(ranks.begin(), ranks.end(), zrand());
+    }
+
+    out_arr(out, (uint32_t)(withscores ? ranks.size() * 2 : ranks.size()));
+    for (int64_t r : ranks)
+    {
+        Znode *z = zset_at(zset, r);
+        out_member(out, zset, z);
+        if (withscores)
+        {
+            out_dbl(out, znode_score(zset, z));
+        }
+    }
+}
+
+// ZQUANTILE key q [q ...] [WITHSCORES]
+// For each q in [0, 1], the member at nearest rank ceil(q * n), lowest score first.
+static void do_zquantile(std::vector<std::string> &cmd, std::string &out)
+{
+    size_t nq = cmd.size() - 2;
+    bool withscores = (cmd.size() > 3 && strcasecmp(cmd.back().c_str(), "WITHSCORES") == 0);
+    if (withscores)
+    {
+        nq--;
+    }
+    std::vector<double> qs(nq);
+    for (size_t i = 0; i < nq; ++i)
+    {
+        if (!str2dbl(cmd[2 + i], qs[i]) || qs[i] < 0 || qs[i] > 1)
+        {
+            out_err(out, RES_ERR, "Quantile must be a number between 0 and 1");
+            return;
+        }
+    }
+
+    Entry *entry = entry_find(cmd[1]);
+    if (entry && entry->type != T_ZSET)
+    {
+        out_err(out, RES_ERR, "Expecting ZSET type");
+        return;
+    }
+    Zset *zset = entry ? &((ZSetEntry *)entry)->zset : NULL;
+    int64_t n = zset ? (int64_t)zset_size(zset) : 0;
+    if (n == 0)
+    {
+        out_arr(out, 0);
+        return;
+    }
+
+    out_arr(out, (uint32_t)(withscores ? nq * 2 : nq));
+    for (double q : qs)
+    {
+        int64_t rank = (int64_t)std::ceil(q * (double)n) - 1;
+        Znode *z = zset_at(zset, std::min(std::max(rank, (int64_t)0), n - 1));
+        out_member(out, zset, z);
+        if (withscores)
+        {
+            out_dbl(out, znode_score(zset, z));
+        }
+    }
+}
+
+// Persistence
+
+static void snapshot_put_entry(SnapWriter *w, Entry *entry)
+{
+    if (entry->type == T_STR)
+    {
+        std::string &val = ((StrEntry *)entry)->val;
+        snap_put_str(w, entry->key.data(), entry->key.size(), val.data(), val.size());
+        return;
+    }
+    Zset *zset = &((ZSetEntry *)entry)->zset;
+    snap_put_zset(w, entry->key.data(), entry->key.size(), zset_size(zset));
+    for (Znode *z = zset_first(zset); z; z = znode_next(zset, z))
+    {
+        ZMember member;
+        znode_member(zset, z, &member);
+        snap_put_member(w, znode_score(zset, z), member.name, member.len);
+    }
+}
+
+// Write every key to the snapshot file, used by SAVE and by the BGSAVE child
+static bool snapshot_save(const std::string &path)
+{
+    std::string tmp = path + ".tmp." + std::to_string(getpid());
+    SnapWriter w;
+    if (!snap_open(&w, tmp.c_str(), hm_size(&g_data.db), g_data.save_epoch, 0))
+    {
+        return false;
+    }
+    HTab *tabs[2] = {&g_data.db.ht1, &g_data.db.ht2};
+    for (HTab *htab : tabs)
+    {
+        for (size_t i = 0; htab->tab && i < htab->mask + 1; ++i)
+        {
+            for (HNode *node = htab->tab[i]; node; node = node->next)
+            {
+                snapshot_put_entry(&w, container_of(node, Entry, node));
+            }
+        }
+    }
+    return snap_close(&w, tmp.c_str(), path.c_str());
+}
+
+// Delta checkpoints, enabled with --checkpoint-every. Each one writes only the
+// keys written since the previous checkpoint to <snapshot>.delta.<n>, on top
+// of the last full snapshot. Once the deltas add up to the size of the full
+// snapshot, or there are k_max_deltas of them, the next checkpoint is a full
+// snapshot again and the deltas are deleted. Checkpoint I/O thus follows the
+// write rate, plus at most as much again for the periodic full snapshot.
+const uint32_t k_max_deltas = 16;
+
+static std::string delta_path(uint32_t n)
+{
+    return g_data.snapshot_path + ".delta." + std::to_string(n);
+}
+
+static uint64_t file_size(const std::string &path)
+{
+    struct stat st = {};
+    return stat(path.c_str(), &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+static bool checkpoint_save_delta(const std::string &path)
+{
+    std::string tmp = path + ".tmp." + std::to_string(getpid());
+    SnapWriter w;
+    if (!snap_open(&w, tmp.c_str(), g_data.saving.size(), g_data.save_epoch, g_data.base_epoch))
+    {
+        return false;
+    }
+    for (const std::string &key : g_data.saving)
+    {
+        Entry *entry = entry_find(key);
+        if (entry)
+        {
+            snapshot_put_entry(&w, entry);
+        }
+        else
+        {
+            snap_put_del(&w, key.data(), key.size());
+        }
+    }
+    return snap_close(&w, tmp.c_str(), path.c_str());
+}
+
+// Close the current epoch: the keys written in it are what the checkpoint covers
+static void checkpoint_begin(bool full)
+{
+    g_data.save_full = full;
+    g_data.save_epoch = g_data.epoch++;
+    g_data.saving.clear();
+    g_data.saving.swap(g_data.dirty);
+}
+
+// A failed checkpoint hands its keys over to the next one
+static void checkpoint_end(bool ok)
+{
+    if (!ok)
+    {
+        g_data.dirty.insert(g_data.saving.begin(), g_data.saving.end());
+    }
+    else if (g_data.save_full)
+    {
+        // the deltas on top of the old base, and any an earlier run left behind
+        for (uint32_t n = 1; n <= g_data.delta_count || access(delta_path(n).c_str(), F_OK) == 0; ++n)
+        {
+            unlink(delta_path(n).c_str());
+        }
+        g_data.base_epoch = g_data.save_epoch;
+        g_data.base_bytes = file_size(g_data.snapshot_path);
+        g_data.delta_count = 0;
+        g_data.delta_bytes = 0;
+    }
+    else
+    {
+        g_data.delta_count++;
+        g_data.delta_bytes += file_size(delta_path(g_data.delta_count));
+    }
+    g_data.saving.clear();
+}
+
+// Decode one chunk of the snapshot into new entries and deleted keys, any thread may run it
+static bool snapshot_load_chunk(const SnapFile *f, size_t i, std::vector<Entry *> &entries,
+                                std::vector<std::string> &dropped)
+{
+    SnapCursor c = snap_chunk(f, i);
+    const char *key = nullptr, *data = nullptr;
+    uint32_t klen = 0, len = 0;
+    int type = 0;
+    while ((type = snap_next_key(&c, &key, &klen)) >= 0)
+    {
+        Entry *entry = nullptr;
+        if (type == SNAP_DEL)
+        {
+            dropped.emplace_back(key, klen);
+            continue;
+        }
+        if (type == SNAP_STR)
+        {
+            StrEntry *str = new StrEntry();
+            entry = str;
+            if (snap_get_str(&c, &data, &len))
+            {
+                str->val.assign(data, len);
+            }
+        }
+        else
+        {
+            ZSetEntry *zset = new ZSetEntry();
+            zset->zset.pool = zset_pool();
+            entry = zset;
+            uint64_t n = 0;
+            if (snap_get_count(&c, &n))
+            {
+                // bounded by the chunk, a bad count fails below instead of reserving memory
+                zset_reserve(&zset->zset, std::min<uint64_t>(n, (c.end - c.pos) / 12));
+            }
+            // members are stored in order, the tree is linked without a sort
+            ZLoad load;
+            load.nodes.reserve(std::min<uint64_t>(n, (c.end - c.pos) / 12));
+            double score = 0;
+            for (uint64_t j = 0; !c.failed && j < n; ++j)
+            {
+                if (snap_get_member(&c, &score, &data, &len))
+                {
+                    zset_load_add(&zset->zset, &load, data, len, score);
+                }
+            }
+            zset_load_build(&zset->zset, &load);
+        }
+        entries.push_back(entry);
+        if (c.failed)
+        {
+            break;
+        }
+        entry->key.assign(key, klen);
+        entry->node.hcode = str_hash((uint8_t *)key, klen);
+    }
+    if (c.failed || entries.size() + dropped.size() != f->chunks[i].nkeys)
+    {
+        for (Entry *entry : entries)
+        {
+            entry_del(entry);
+        }
+        entries.clear();
+        return false;
+    }
+    return true;
+}
+
+static void db_remove(const std::string &name)
+{
+    Entry key;
+    key.key = name;
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = hm_pop(&g_data.db, &key.node, &entry_eq);
+    if (node)
+    {
+        entry_del(container_of(node, Entry, node));
+    }
+}
+
+// Load a mapped snapshot, or apply a delta on top of what is loaded, and unmap it.
+// Chunks are decoded by one thread per core and linked into the keyspace,
+// which is sized for every key up front, under a lock.
+static bool snapshot_apply(const std::string &path, SnapFile &f, bool delta)
+{
+    uint64_t start = get_monotonic_msec();
+    hm_reserve(&g_data.db, hm_size(&g_data.db) + f.nkeys);
+    size_t nthreads = g_data.load_threads ? g_data.load_threads : std::thread::hardware_concurrency();
+    // the pool of shared member names is not thread-safe
+    nthreads = zset_pool() ? 1 : std::max<size_t>(nthreads, 1);
+    nthreads = std::min(nthreads, std::max<size_t>(f.chunks.size(), 1));
+    std::atomic<size_t> next{0};
+    std::atomic<bool> failed{false};
+    std::atomic<size_t> bad_chunk{0};
+    std::atomic<bool> bad_crc{false};
+    std::mutex db_lock;
+    auto worker = [&]()
+    {
+        std::vector<Entry *> entries;
+        std::vector<std::string> dropped;
+        size_t i = 0;
+        while (!failed && (i = next++) < f.chunks.size())
+        {
+            entries.clear();
+            dropped.clear();
+            bool crc_ok = snap_check_chunk(&f, i);
+            if (!crc_ok || !snapshot_load_chunk(&f, i, entries, dropped))
+            {
+                bad_crc = !crc_ok;
+                bad_chunk = i;
+                failed = true;
+                break;
+            }
+            std::lock_guard<std::mutex> guard(db_lock);
+            for (const std::string &key : dropped)
+            {
+                db_remove(key);
+            }
+            for (Entry *entry : entries)
+            {
+                if (delta)
+                {
+                    db_remove(entry->key);
+                }
+                hm_insert(&g_data.db, &entry->node);
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < nthreads; ++t)
+    {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &t : threads)
+    {
+        t.join();
+    }
+    snap_unmap(&f);
+
+    if (failed)
+    {
+        fprintf(stderr, "Cannot load %s: chunk %zu %s\n", path.c_str(), (size_t)bad_chunk,
+                bad_crc ? "does not match its checksum" : "cannot be decoded");
+        return false;
+    }
+    printf("%s %llu keys from %s in %llu ms with %zu threads\n", delta ? "Applied" : "Loaded",
+           (unsigned long long)f.nkeys, path.c_str(), (unsigned long long)(get_monotonic_msec() - start),
+           nthreads);
+    return true;
+}
+
+// Read the snapshot at startup, then the deltas written on top of it in order.
+// A missing file is an empty database, a damaged one is an error: the server
+// does not start with partial data. A delta of an older base, left behind by
+// a crash, ends the chain.
+static bool snapshot_load(const std::string &path)
+{
+    SnapFile f;
+    bool exists = false;
+    if (!snap_map(&f, path.c_str(), &exists) || !exists || f.base_epoch)
+    {
+        snap_unmap(&f);
+        if (exists)
+        {
+            fprintf(stderr, "Cannot load %s: %s\n", path.c_str(),
+                    f.base_epoch ? "a delta checkpoint, not a full snapshot" : f.err.c_str());
+        }
+        return !exists;
+    }
+    g_data.base_epoch = f.epoch;
+    g_data.base_bytes = f.size;
+    g_data.epoch = f.epoch + 1;
+    if (!snapshot_apply(path, f, false))
+    {
+        return false;
+    }
+
+    for (uint32_t n = 1;; ++n)
+    {
+        std::string dpath = delta_path(n);
+        SnapFile d;
+        if (!snap_map(&d, dpath.c_str(), &exists) || !exists)
+        {
+            snap_unmap(&d);
+            if (exists)
+            {
+                fprintf(stderr, "Cannot load %s: %s\n", dpath.c_str(), d.err.c_str());
+            }
+            return !exists;
+        }
+        if (d.base_epoch != g_data.base_epoch || d.epoch < g_data.epoch)
+        {
+            printf("Ignoring %s, it is older than the checkpoints before it\n", dpath.c_str());
+            snap_unmap(&d);
+            return true;
+        }
+        g_data.delta_count = n;
+        g_data.delta_bytes += d.size;
+        g_data.epoch = d.epoch + 1;
+        if (!snapshot_apply(dpath, d, true))
+        {
+            return false;
+        }
+    }
+}
+
+// Fork-free snapshot, enabled with --bgsave-nofork. The event loop writes the
+// keyspace as it was when the snapshot started, k_isnap_step entries (or
+// sorted set members) per iteration. Rehashing is paused meanwhile, so every
+// entry that existed at the start stays in the bucket arrays captured then.
+// An entry records the snapshot that has written it; new entries start out
+// marked. entry_touch() writes an entry that is not marked yet before it is
+// changed or deleted (copy-before-write). Extra memory is the write buffer.
+const size_t k_isnap_step = 4096;
+
+static void isnap_write(Entry *entry)
+{
+    snapshot_put_entry(&g_data.isnap->w, entry);
+    entry->isnap = g_isnap_seq;
+    g_data.isnap->left--;
+}
+
+static bool isnap_start()
+{
+    checkpoint_begin(true);
+    IncrSnapshot *snap = new IncrSnapshot();
+    snap->tmp = g_data.snapshot_path + ".tmp." + std::to_string(getpid());
+    snap->left = hm_size(&g_data.db);
+    if (!snap_open(&snap->w, snap->tmp.c_str(), snap->left, g_data.save_epoch, 0))
+    {
+        delete snap;
+        checkpoint_end(false);
+        return false;
+    }
+    HTab *tabs[2] = {&g_data.db.ht1, &g_data.db.ht2};
+    for (HTab *htab : tabs)
+    {
+        if (htab->tab)
+        {
+            snap->tabs.push_back(*htab);
+        }
+    }
+    g_isnap_seq++;
+    g_data.isnap = snap;
+    g_data.db.paused = true;
+    return true;
+}
+
+// Write the next few entries, and finish the file once every bucket is done.
+// Returns the poll() timeout: none while there is work left.
+static int isnap_step(int timeout_ms)
+{
+    IncrSnapshot *snap = g_data.isnap;
+    if (!snap)
+    {
+        return timeout_ms;
+    }
+    size_t work = 0;
+    while (work < k_isnap_step && snap->tab < snap->tabs.size())
+    {
+        HTab &htab = snap->tabs[snap->tab];
+        work++;
+        for (HNode *node = htab.tab[snap->pos]; node; node = node->next)
+        {
+            Entry *entry = container_of(node, Entry, node);
+            if (entry->isnap != g_isnap_seq)
+            {
+                work += 1 + (entry->type == T_ZSET ? zset_size(&((ZSetEntry *)entry)->zset) : 0);
+                isnap_write(entry);
+            }
+        }
+        if (++snap->pos > htab.mask)
+        {
+            snap->tab++;
+            snap->pos = 0;
+        }
+    }
+    if (snap->tab < snap->tabs.size())
+    {
+        return 0;
+    }
+
+    // every entry of the start was written exactly once
+    bool ok = snap->left == 0;
+    ok = snap_close(&snap->w, snap->tmp.c_str(), g_data.snapshot_path.c_str()) && ok;
+    checkpoint_end(ok);
+    printf("Background save %s (no fork)\n", ok ? "done" : "failed");
+    delete snap;
+    g_data.isnap = nullptr;
+    g_data.db.paused = false;
+    return timeout_ms;
+}
+
+static bool save_in_progress()
+{
+    return g_data.save_pid > 0 || g_data.isnap;
+}
+
+// Start writing a full snapshot or a delta. A delta, or a full snapshot unless
+// --bgsave-nofork is set, is written by a forked child from its copy-on-write
+// view of the keyspace.
+static bool checkpoint_start(bool full)
+{
+    if (full && g_data.bgsave_nofork)
+    {
+        return isnap_start();
+    }
+    checkpoint_begin(full);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        checkpoint_end(false);
+        return false;
+    }
+    if (pid == 0)
+    {
+        // the delta looks keys up, a rehashing step would write to (and copy)
+        // the pages the parent shares with the child
+        g_data.db.paused = true;
+        bool ok = full ? snapshot_save(g_data.snapshot_path)
+                       : checkpoint_save_delta(delta_path(g_data.delta_count + 1));
+        _exit(ok ? 0 : 1);
+    }
+    g_data.save_pid = pid;
+    // moving nodes between tables would copy the pages the child still reads
+    g_data.db.paused = true;
+    return true;
+}
+
+// Checkpoint once the interval is up and something was written.
+// Returns the poll() timeout until the next checkpoint.
+static int checkpoint_tick(int timeout_ms)
+{
+    if (!g_data.checkpoint_ms)
+    {
+        return timeout_ms;
+    }
+    uint64_t now = get_monotonic_msec();
+    if (now >= g_data.next_checkpoint_ms && !save_in_progress() && g_data.rewrite_pid <= 0)
+    {
+        g_data.next_checkpoint_ms = now + g_data.checkpoint_ms;
+        if (!g_data.dirty.empty() || !g_data.base_epoch)
+        {
+            bool full = !g_data.base_epoch || g_data.delta_count >= k_max_deltas ||
+                        g_data.delta_bytes >= g_data.base_bytes;
+            if (!checkpoint_start(full))
+            {
+                die("checkpoint error");
+            }
+        }
+    }
+    return (int)std::min<uint64_t>((uint64_t)timeout_ms,
+                                   g_data.next_checkpoint_ms > now ? g_data.next_checkpoint_ms - now : 0);
+}
+
+static void do_save(std::string &out)
+{
+    if (save_in_progress())
+    {
+        out_err(out, RES_ERR, "Background save already in progress");
+        return;
+    }
+    checkpoint_begin(true);
+    bool ok = snapshot_save(g_data.snapshot_path);
+    checkpoint_end(ok);
+    if (!ok)
+    {
+        out_err(out, RES_ERR, "Snapshot failed");
+        return;
+    }
+    out_str(out, "OK");
+}
+
+static void do_bgsave(std::string &out)
+{
+    if (save_in_progress() || g_data.rewrite_pid > 0)
+    {
+        out_err(out, RES_ERR, "Background save or AOF rewrite already in progress");
+        return;
+    }
+    if (!checkpoint_start(true))
+    {
+        out_err(out, RES_ERR, g_data.bgsave_nofork ? "Cannot create the snapshot file" : "fork() failed");
+        return;
+    }
+    out_str(out, "Background saving started");
+}
+
+// Reap the BGSAVE or checkpoint child once it exits and resume rehashing
+static void snapshot_poll()
+{
+    if (g_data.save_pid <= 0)
+    {
+        return;
+    }
+    int status = 0;
+    pid_t rv = waitpid(g_data.save_pid, &status, WNOHANG);
+    if (rv == 0)
+    {
+        return;
+    }
+    bool ok = rv > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    size_t keys = g_data.saving.size();
+    checkpoint_end(ok);
+    if (g_data.save_full)
+    {
+        printf("Background save %s\n", ok ? "done" : "failed");
+    }
+    else
+    {
+        printf("Delta checkpoint of %zu keys %s\n", keys, ok ? "done" : "failed");
+    }
+    g_data.save_pid = -1;
+    g_data.db.paused = false;
+}
+
+// Write the commands that recreate the keyspace to a new log at path:
+// one SET per string, ZADDs of as many members as a request can carry
+static bool aof_rewrite(const std::string &path)
+{
+    std::string tmp = path + ".tmp." + std::to_string(getpid());
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    std::string buf, block;
+    auto put_block = [&]()
+    {
+        aof_put_block(block, buf.data(), buf.size());
+        buf.clear();
+        bool done = write_all(fd, block.data(), block.size());
+        block.clear();
+        return done;
+    };
+    bool ok = write_all(fd, k_aof_magic, sizeof(k_aof_magic));
+    HTab *tabs[2] = {&g_data.db.ht1, &g_data.db.ht2};
+    for (HTab *htab : tabs)
+    {
+        for (size_t i = 0; ok && htab->tab && i < htab->mask + 1; ++i)
+        {
+            for (HNode *node = htab->tab[i]; node; node = node->next)
+            {
+                Entry *entry = container_of(node, Entry, node);
+                if (entry->type == T_STR)
+                {
+                    aof_encode(buf, {"set", entry->key, ((StrEntry *)entry)->val});
+                    continue;
+                }
+                std::vector<std::string> cmd = {"zadd", entry->key};
+                size_t size = 4 + 8 + 4 + entry->key.size();
+                Zset *zset = &((ZSetEntry *)entry)->zset;
+                for (Znode *z = zset_first(zset); z; z = znode_next(zset, z))
+                {
+                    char score[32];
+                    int n = snprintf(score, sizeof(score), "%.17g", znode_score(zset, z));
+                    ZMember member;
+                    znode_member(zset, z, &member);
+                    size_t more = 8 + (size_t)n + member.len;
+                    if (cmd.size() > 2 && (cmd.size() + 2 > k_max_args || size + more > k_max_msg))
+                    {
+                        aof_encode(buf, cmd);
+                        cmd.resize(2);
+                        size = 4 + 8 + 4 + entry->key.size();
+                    }
+                    cmd.push_back(score);
+                    cmd.push_back(std::string(member.name, member.len));
+                    size += more;
+                }
+                if (cmd.size() > 2)
+                {
+                    aof_encode(buf, cmd);
+                }
+            }
+            if (buf.size() >= k_snap_buf)
+            {
+                ok = put_block();
+            }
+        }
+    }
+    ok = ok && (buf.empty() || put_block()) && fsync(fd) == 0;
+    ok = (close(fd) == 0) && ok;
+    if (ok && rename(tmp.c_str(), path.c_str()) != 0)
     {
-        out_arr(out, 0);
-        return;
+        ok = false;
     }
-
-    int64_t count = stop - start + 1;
-    out_arr(out, withscores ? count * 2 : count);
-
-    // Find the first element
-    Znode *node_start = nullptr;
-    if (zset->zset.tree)
+    if (!ok)
     {
-        AVLNode *avl = zset->zset.tree;
-
-        // Get the leftmost node (lowest score)
-        while (avl->left)
-        {
-            avl = avl->left;
-        }
+        unlink(tmp.c_str());
+    }
+    return ok;
+}
 
-        // Move to the start position
-        if (start > 0)
-        {
-            avl = avl_offset(avl, start);
-        }
+// BGREWRITEAOF: the child writes the compact log next to the live one while
+// the parent keeps appending to the old log and also keeps every write since
+// the fork in rewrite_buf. Once the child is done the parent appends that
+// tail to the new log, renames it over the old one and switches over.
+static std::string aof_rewrite_path()
+{
+    return g_data.aof_path + ".rewrite";
+}
 
-        if (avl)
-        {
-            node_start = container_of(avl, Znode, tree);
-        }
+static void do_bgrewriteaof(std::string &out)
+{
+    if (g_data.aof_fd < 0)
+    {
+        out_err(out, RES_ERR, "AOF is not enabled");
+        return;
     }
-
-    // Output the range
-    AVLNode *current = node_start ? &node_start->tree : nullptr;
-    for (int64_t i = 0; i < count && current; ++i)
+    if (save_in_progress() || g_data.rewrite_pid > 0)
     {
-        Znode *z = container_of(current, Znode, tree);
-
-        // Output member
-        out_str(out, std::string(z->name, z->len));
+        out_err(out, RES_ERR, "Background save or AOF rewrite already in progress");
+        return;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        out_err(out, RES_ERR, "fork() failed");
+        return;
+    }
+    if (pid == 0)
+    {
+        _exit(aof_rewrite(aof_rewrite_path()) ? 0 : 1);
+    }
+    g_data.rewrite_pid = pid;
+    g_data.rewrite_buf.clear();
+    // commands of this iteration that are still buffered are already in the child's copy
+    g_data.rewrite_skip = g_data.aof_buf.size();
+    g_data.db.paused = true;
+    out_str(out, "Background append only file rewriting started");
+}
 
-        // Output score if requested
-        if (withscores)
-        {
-            out_dbl(out, z->score);
-        }
+// Append the writes made during the rewrite and make the new log the live one
+static bool aof_rewrite_finish()
+{
+    std::string path = aof_rewrite_path();
+    int fd = open(path.c_str(), O_WRONLY | O_APPEND);
+    if (fd < 0)
+    {
+        return false;
+    }
+    if (!write_all(fd, g_data.rewrite_buf.data(), g_data.rewrite_buf.size()) || fsync(fd) != 0 ||
+        rename(path.c_str(), g_data.aof_path.c_str()) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    // waits for an fdatasync() of the old log in progress
+    std::lock_guard<std::mutex> lock(g_data.aof_fd_lock);
+    int old = g_data.aof_fd.exchange(fd);
+    close(old);
+    return true;
+}
 
-        // Move to next node
-        if (current->right)
-        {
-            current = current->right;
-            while (current->left)
-            {
-                current = current->left;
-            }
-        }
-        else
-        {
-            // Backtrack to find the next node
-            AVLNode *parent = current->parent;
-            while (parent && parent->right == current)
-            {
-                current = parent;
-                parent = current->parent;
-            }
-            current = parent;
-        }
+// Reap the BGREWRITEAOF child once it exits
+static void aof_rewrite_poll()
+{
+    if (g_data.rewrite_pid <= 0)
+    {
+        return;
+    }
+    int status = 0;
+    pid_t rv = waitpid(g_data.rewrite_pid, &status, WNOHANG);
+    if (rv == 0)
+    {
+        return;
     }
+    bool ok = rv > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 && aof_rewrite_finish();
+    if (!ok)
+    {
+        unlink(aof_rewrite_path().c_str());
+    }
+    printf("Background AOF rewrite %s (%zu bytes written meanwhile)\n", ok ? "done" : "failed",
+           g_data.rewrite_buf.size());
+    g_data.rewrite_pid = -1;
+    g_data.rewrite_buf.clear();
+    g_data.rewrite_buf.shrink_to_fit();
+    g_data.db.paused = false;
 }
 
 // Process request based on command
-static void do_request(std::vector<std::string> &cmd, std::string &out)
+static void do_request(Conn *conn, std::vector<std::string> &cmd, std::string &out)
 {
     if (cmd.empty())
     {
@@ -672,10 +2719,26 @@ static void do_request(std::vector<std::string> &cmd, std::string &out)
     std::transform(command.begin(), command.end(), command.begin(), ::tolower);
 
     // Handle commands
-    if (command == "keys")
+    if (g_data.dataset.data && command != "get")
+    {
+        out_err(out, RES_ERR, "Read-only dataset, only GET is served");
+    }
+    else if (command == "keys")
     {
         do_keys(cmd, out);
     }
+    else if (command == "save" && cmd.size() == 1)
+    {
+        do_save(out);
+    }
+    else if (command == "bgsave" && cmd.size() == 1)
+    {
+        do_bgsave(out);
+    }
+    else if (command == "bgrewriteaof" && cmd.size() == 1)
+    {
+        do_bgrewriteaof(out);
+    }
     else if (command == "get" && cmd.size() == 2)
     {
         do_get(cmd, out);
@@ -693,13 +2756,65 @@ static void do_request(std::vector<std::string> &cmd, std::string &out)
     {
         do_zadd(cmd, out);
     }
+    else if (command == "zincrby" && cmd.size() == 4)
+    {
+        do_zincrby(cmd, out);
+    }
+    else if (command == "zunionstore" && cmd.size() >= 4)
+    {
+        do_zsetop(cmd, out, ZOP_UNION);
+    }
+    else if (command == "zinterstore" && cmd.size() >= 4)
+    {
+        do_zsetop(cmd, out, ZOP_INTER);
+    }
+    else if (command == "zdiffstore" && cmd.size() >= 4)
+    {
+        do_zsetop(cmd, out, ZOP_DIFF);
+    }
+    else if (command == "zrem" && cmd.size() >= 3)
+    {
+        do_zrem(cmd, out);
+    }
+    else if ((command == "zpopmin" || command == "zpopmax") && cmd.size() >= 2 && cmd.size() <= 3)
+    {
+        do_zpop(cmd, out, command == "zpopmax");
+    }
+    else if ((command == "bzpopmin" || command == "bzpopmax") && cmd.size() >= 3)
+    {
+        do_bzpop(conn, cmd, out, command == "bzpopmax");
+    }
+    else if (command == "zsumrange" && cmd.size() == 4)
+    {
+        do_zsumrange(cmd, out, false);
+    }
+    else if (command == "zsumrangebyscore" && cmd.size() == 4)
+    {
+        do_zsumrange(cmd, out, true);
+    }
     else if (command == "zscore" && cmd.size() == 3)
     {
         do_zscore(cmd, out);
     }
     else if ((command == "zrange" && cmd.size() >= 4 && cmd.size() <= 5))
     {
-        do_zrange(cmd, out);
+        do_zrange(cmd, out, false);
+    }
+    else if ((command == "zrevrange" && cmd.size() >= 4 && cmd.size() <= 5))
+    {
+        do_zrange(cmd, out, true);
+    }
+    else if (command == "zrangepage" && cmd.size() >= 4 && cmd.size() <= 6)
+    {
+        do_zrangepage(cmd, out);
+    }
+    else if (command == "zrandmember" && cmd.size() >= 2 && cmd.size() <= 4)
+    {
+        do_zrandmember(cmd, out);
+    }
+    else if (command == "zquantile" && cmd.size() >= 3)
+    {
+        do_zquantile(cmd, out);
     }
     else
     {
@@ -774,6 +2889,14 @@ static bool try_one_request(Conn *conn)
         return false;
     }
 
+    // A blocking command is not parked behind replies still held for the log:
+    // it is run once they are sent
+    if (conn->state == STATE_RES && !cmd.empty() &&
+        (strcasecmp(cmd[0].c_str(), "bzpopmin") == 0 || strcasecmp(cmd[0].c_str(), "bzpopmax") == 0))
+    {
+        return false;
+    }
+
     // Log the command
     if (!cmd.empty())
     {
@@ -787,21 +2910,16 @@ static bool try_one_request(Conn *conn)
         printf("\n");
     }
 
-    // Generate the response
-    std::string out;
-    do_request(cmd, out);
-
-    if (4 + out.size() > k_max_msg)
+    // Generate the response straight into the write buffer
+    bool logged = g_data.aof_fd >= 0 && !cmd.empty() && aof_is_write(cmd[0]);
+    size_t hdr = out_begin(conn);
+    do_request(conn, cmd, conn->wbuf);
+    // a write that was refused changed nothing
+    if (logged && conn->wbuf.size() > hdr + 4 && conn->wbuf[hdr + 4] != SER_ERR)
     {
-        out.clear();
-        out_err(out, RES_ERR, "response is too big");
+        aof_append_raw(&conn->rbuf[4], len);
     }
 
-    uint32_t wlen = (uint32_t)out.size();
-    memcpy(&conn->wbuf[0], &wlen, 4);
-    memcpy(&conn->wbuf[4], out.data(), out.size());
-    conn->wbuf_size = 4 + wlen;
-
     // Remove the processed request from the buffer
     size_t remain = conn->rbuf_size - 4 - len;
     if (remain)
@@ -810,11 +2928,62 @@ static bool try_one_request(Conn *conn)
     }
     conn->rbuf_size = remain;
 
+    if (conn->state == STATE_BLOCK)
+    {
+        // The reply is sent when a key gets a member or the timeout expires
+        conn->wbuf.resize(hdr);
+        return false;
+    }
+
+    out_end(conn, hdr);
+    // a held reply does not stop the pipeline: the requests behind it are
+    // answered in the same iteration and share its fdatasync
+    return conn->state == STATE_REQ || (conn->state == STATE_RES && aof_holds_replies());
+}
+
+// Reserve the length prefix of a response at the end of the write buffer
+static size_t out_begin(Conn *conn)
+{
+    size_t hdr = conn->wbuf.size();
+    conn->wbuf.append(4, '\0');
+    return hdr;
+}
+
+// Fill in the length prefix of the response and start sending it
+static void out_end(Conn *conn, size_t hdr)
+{
+    size_t size = conn->wbuf.size() - hdr - 4;
+    if (size > k_max_resp)
+    {
+        conn->wbuf.resize(hdr + 4);
+        out_err(conn->wbuf, RES_ERR, "response is too big");
+        size = conn->wbuf.size() - hdr - 4;
+    }
+
+    uint32_t wlen = (uint32_t)size;
+    memcpy(&conn->wbuf[hdr], &wlen, 4);
+
     // Change state to response mode
     conn->state = STATE_RES;
-    state_res(conn); // Try to send response immediately
+    if (!aof_holds_replies())
+    {
+        state_res(conn); // Try to send response immediately
+    }
+}
 
-    return (conn->state == STATE_REQ);
+// Reset the write buffer once everything is sent, dropping a large allocation
+static void wbuf_reset(Conn *conn)
+{
+    conn->state = STATE_REQ;
+    conn->wbuf_sent = 0;
+    if (conn->wbuf.capacity() > k_wbuf_keep)
+    {
+        std::string().swap(conn->wbuf);
+    }
+    else
+    {
+        conn->wbuf.clear();
+    }
 }
 
 static bool try_flush_buffer(Conn *conn)
@@ -822,13 +2991,11 @@ static bool try_flush_buffer(Conn *conn)
     ssize_t rv = 0;
     do
     {
-        size_t remain = conn->wbuf_size - conn->wbuf_sent;
+        size_t remain = conn->wbuf.size() - conn->wbuf_sent;
         if (remain == 0)
         {
             // Nothing to send, switch back to receiving mode
-            conn->state = STATE_REQ;
-            conn->wbuf_sent = 0;
-            conn->wbuf_size = 0;
+            wbuf_reset(conn);
             return false;
         }
 
@@ -848,12 +3015,10 @@ static bool try_flush_buffer(Conn *conn)
 
     conn->wbuf_sent += rv;
 
-    if (conn->wbuf_sent == conn->wbuf_size)
+    if (conn->wbuf_sent == conn->wbuf.size())
     {
         // Response fully sent, switch back to request mode
-        conn->state = STATE_REQ;
-        conn->wbuf_sent = 0;
-        conn->wbuf_size = 0;
+        wbuf_reset(conn);
         return false;
     }
     return true; // More data to send
@@ -880,6 +3045,7 @@ static void conn_cleanup(std::vector<Conn *> &fd2conn)
         if (conn->state == STATE_END)
         {
             printf("Cleaning up connection fd %d\n", conn->fd);
+            conn_unblock(conn);
             close(conn->fd);
             fd2conn[i] = nullptr;
             delete conn;
@@ -887,6 +3053,167 @@ static void conn_cleanup(std::vector<Conn *> &fd2conn)
     }
 }
 
+// Replay the log at startup. A block cut short by a crash is dropped and
+// the file truncated before it; a checksum mismatch or anything else
+// unreadable stops the server.
+static bool aof_load(const std::string &path, bool *exists)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    *exists = (fd >= 0 || errno != ENOENT);
+    if (fd < 0)
+    {
+        if (*exists)
+        {
+            fprintf(stderr, "Cannot load %s: %s\n", path.c_str(), strerror(errno));
+        }
+        return !*exists;
+    }
+    struct stat st = {};
+    std::string data;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok)
+    {
+        data.resize((size_t)st.st_size);
+        size_t got = 0;
+        while (ok && got < data.size())
+        {
+            ssize_t rv = read(fd, &data[got], data.size() - got);
+            ok = rv > 0 || (rv < 0 && errno == EINTR);
+            got += rv > 0 ? (size_t)rv : 0;
+        }
+    }
+    close(fd);
+    if (!ok)
+    {
+        fprintf(stderr, "Cannot load %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!aof_has_magic(data.data(), data.size()))
+    {
+        fprintf(stderr, "Cannot load %s: not an append-only file\n", path.c_str());
+        return false;
+    }
+    size_t pos = sizeof(k_aof_magic);
+    uint64_t count = 0;
+    std::vector<std::string> cmd;
+    std::string out;
+    const char *block = nullptr;
+    uint32_t size = 0;
+    int rv = 0;
+    while ((rv = aof_next_block(data.data(), data.size(), &pos, &block, &size)) == AOF_BLOCK_OK)
+    {
+        for (uint32_t off = 0; off < size;)
+        {
+            uint32_t len = 0;
+            memcpy(&len, block + off, 4);
+            cmd.clear();
+            if (parse_req((const uint8_t *)block + off + 4, len, cmd) != 0 || cmd.empty())
+            {
+                fprintf(stderr, "Cannot load %s: bad command at offset %zu\n", path.c_str(),
+                        (size_t)(block - data.data()) + off);
+                return false;
+            }
+            out.clear();
+            do_request(nullptr, cmd, out);
+            off += 4 + len;
+            count++;
+        }
+    }
+    if (rv == AOF_BLOCK_BAD_CRC || rv == AOF_BLOCK_BAD_REQUEST)
+    {
+        fprintf(stderr, "Cannot load %s: %s at offset %zu\n"
+                        "persist_check --fix %s truncates the log there, dropping every later write\n",
+                path.c_str(), aof_block_error(rv), pos, path.c_str());
+        return false;
+    }
+    if (rv == AOF_BLOCK_PARTIAL)
+    {
+        fprintf(stderr, "%s: dropping a partial block at offset %zu\n", path.c_str(), pos);
+        if (truncate(path.c_str(), (off_t)pos) != 0)
+        {
+            fprintf(stderr, "Cannot truncate %s: %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+    }
+    printf("Replayed %llu commands from %s\n", (unsigned long long)count, path.c_str());
+    return true;
+}
+
+// Load the log, or the snapshot when there is no log yet: it is then turned
+// into the first log so that later restarts need nothing else
+static bool aof_start()
+{
+    bool exists = false;
+    if (!aof_load(g_data.aof_path, &exists))
+    {
+        return false;
+    }
+    if (!exists && (!snapshot_load(g_data.snapshot_path) || !aof_rewrite(g_data.aof_path)))
+    {
+        fprintf(stderr, "Cannot create %s\n", g_data.aof_path.c_str());
+        return false;
+    }
+    g_data.aof_fd = open(g_data.aof_path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (g_data.aof_fd < 0)
+    {
+        fprintf(stderr, "Cannot open %s: %s\n", g_data.aof_path.c_str(), strerror(errno));
+        return false;
+    }
+    if (g_data.aof_fsync == AOF_FSYNC_EVERYSEC)
+    {
+        std::thread(aof_fsync_thread).detach();
+    }
+    return true;
+}
+
+// Map the read-only dataset; at startup a missing file is an error too
+static bool dataset_map(DsFile *f)
+{
+    bool exists = false;
+    if (!ds_map(f, g_data.dataset_path.c_str(), &exists) || !exists)
+    {
+        fprintf(stderr, "Cannot load %s: %s\n", g_data.dataset_path.c_str(), exists ? f->err.c_str() : "no such file");
+        return false;
+    }
+    return true;
+}
+
+// Once a second, remap the dataset if a new file was renamed over it. Replies
+// are copied out of the mapping, so the old one can go right away. The file must
+// only be replaced by a rename: truncating it in place would fault the server.
+static int dataset_poll(int timeout_ms)
+{
+    if (!g_data.dataset.data)
+    {
+        return timeout_ms;
+    }
+    uint64_t now = get_monotonic_msec();
+    if (now >= g_data.dataset_check_ms)
+    {
+        g_data.dataset_check_ms = now + 1000;
+        struct stat st = {};
+        if (stat(g_data.dataset_path.c_str(), &st) == 0 &&
+            (st.st_ino != g_data.dataset.ino || st.st_dev != g_data.dataset.dev))
+        {
+            DsFile f;
+            if (dataset_map(&f))
+            {
+                ds_unmap(&g_data.dataset);
+                g_data.dataset = f;
+                printf("Switched to %s: %llu keys\n", g_data.dataset_path.c_str(), (unsigned long long)f.nkeys);
+            }
+            else
+            {
+                // still a different file, try again on the next check
+                g_data.dataset.ino = st.st_ino;
+                g_data.dataset.dev = st.st_dev;
+            }
+        }
+    }
+    return (int)std::min<uint64_t>((uint64_t)timeout_ms, g_data.dataset_check_ms - now);
+}
+
 // Cleanup database entries when server is shutting down
 static void db_cleanup()
 {
@@ -898,14 +3225,7 @@ static void db_cleanup()
         {
             HNode *next = node->next;
             Entry *entry = container_of(node, Entry, node);
-            if (entry->type == T_ZSET)
-            {
-                delete (ZSetEntry *)entry;
-            }
-            else
-            {
-                delete (StrEntry *)entry;
-            }
+            entry_del(entry);
             node = next;
         }
     }
@@ -918,14 +3238,7 @@ static void db_cleanup()
         {
             HNode *next = node->next;
             Entry *entry = container_of(node, Entry, node);
-            if (entry->type == T_ZSET)
-            {
-                delete (ZSetEntry *)entry;
-            }
-            else
-            {
-                delete (StrEntry *)entry;
-            }
+            entry_del(entry);
             node = next;
         }
     }
@@ -935,8 +3248,79 @@ static void db_cleanup()
     free(g_data.db.ht2.tab);
 }
 
-int main()
+int main(int argc, char **argv)
 {
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--zrange-cache") == 0)
+        {
+            g_data.zrange_cache = true;
+        }
+        else if (strcmp(argv[i], "--intern-members") == 0)
+        {
+            g_data.intern_members = true;
+        }
+        else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc)
+        {
+            g_data.snapshot_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc)
+        {
+            g_data.checkpoint_ms = strtoull(argv[++i], nullptr, 10) * 1000;
+        }
+        else if (strcmp(argv[i], "--bgsave-nofork") == 0)
+        {
+            g_data.bgsave_nofork = true;
+        }
+        else if (strcmp(argv[i], "--load-threads") == 0 && i + 1 < argc)
+        {
+            g_data.load_threads = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--dataset") == 0 && i + 1 < argc)
+        {
+            g_data.dataset_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--aof") == 0 && i + 1 < argc)
+        {
+            g_data.aof_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--appendfsync") == 0 && i + 1 < argc && !strcmp(argv[i + 1], "always"))
+        {
+            g_data.aof_fsync = AOF_FSYNC_ALWAYS, i++;
+        }
+        else if (strcmp(argv[i], "--appendfsync") == 0 && i + 1 < argc && !strcmp(argv[i + 1], "everysec"))
+        {
+            g_data.aof_fsync = AOF_FSYNC_EVERYSEC, i++;
+        }
+        else if (strcmp(argv[i], "--appendfsync") == 0 && i + 1 < argc && !strcmp(argv[i + 1], "no"))
+        {
+            g_data.aof_fsync = AOF_FSYNC_NO, i++;
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--zrange-cache] [--intern-members] [--snapshot path]\n"
+                            "       [--checkpoint-every secs] [--bgsave-nofork] [--load-threads n]\n"
+                            "       [--aof path [--appendfsync always|everysec|no]] [--dataset path]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (!g_data.dataset_path.empty())
+    {
+        // nothing is written, the snapshot and the log are not used
+        if (!dataset_map(&g_data.dataset))
+        {
+            return 1;
+        }
+        printf("Serving %llu keys read-only from %s\n", (unsigned long long)g_data.dataset.nkeys,
+               g_data.dataset_path.c_str());
+    }
+    // With a log, it holds every write since it was created and wins over the snapshot
+    else if (g_data.aof_path.empty() ? !snapshot_load(g_data.snapshot_path) : !aof_start())
+    {
+        return 1;
+    }
+
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0)
     {
@@ -974,9 +3358,22 @@ int main()
     printf("  SET key value\n");
     printf("  DEL key\n");
     printf("  KEYS\n");
-    printf("  ZADD key score member [score member ...]\n");
+    printf("  SAVE, BGSAVE, BGREWRITEAOF\n");
+    printf("  ZADD key [NX|XX] [GT|LT] [INCR] score member [score member ...]\n");
+    printf("  ZINCRBY key increment member\n");
     printf("  ZSCORE key member\n");
+    printf("  ZREM key member [member ...]\n");
+    printf("  ZPOPMIN key [count], ZPOPMAX key [count]\n");
+    printf("  BZPOPMIN key [key ...] timeout, BZPOPMAX key [key ...] timeout\n");
+    printf("  ZUNIONSTORE dest numkeys key [key ...] [WEIGHTS weight ...] [AGGREGATE SUM|MIN|MAX]\n");
+    printf("  ZINTERSTORE dest numkeys key [key ...] [WEIGHTS weight ...] [AGGREGATE SUM|MIN|MAX]\n");
+    printf("  ZDIFFSTORE dest numkeys key [key ...]\n");
     printf("  ZRANGE key start stop [WITHSCORES]\n");
+    printf("  ZREVRANGE key start stop [WITHSCORES]\n");
+    printf("  ZRANGEPAGE key cursor count [WITHSCORES] [REV]\n");
+    printf("  ZRANDMEMBER key [count [WITHSCORES]]\n");
+    printf("  ZQUANTILE key q [q ...] [WITHSCORES]\n");
+    printf("  ZSUMRANGE key start stop, ZSUMRANGEBYSCORE key min max\n");
 
     std::vector<Conn *> fd2conn;
     fd_set_nb(fd); // Set server socket to non-blocking
@@ -988,6 +3385,20 @@ int main()
         // Clean up closed connections first
         conn_cleanup(fd2conn);
 
+        // Time out blocked clients, poll() waits at most until the next deadline
+        int timeout_ms = process_timers(fd2conn);
+
+        // Notice a finished BGSAVE or BGREWRITEAOF soon, rehashing is paused until then
+        snapshot_poll();
+        aof_rewrite_poll();
+        if (g_data.save_pid > 0 || g_data.rewrite_pid > 0)
+        {
+            timeout_ms = std::min(timeout_ms, 100);
+        }
+        timeout_ms = checkpoint_tick(timeout_ms);
+        timeout_ms = isnap_step(timeout_ms);
+        timeout_ms = dataset_poll(timeout_ms);
+
         // Prepare for polling
         poll_args.clear();
         struct pollfd pfd = {fd, POLLIN, 0};
@@ -1002,13 +3413,16 @@ int main()
 
             struct pollfd pfd = {};
             pfd.fd = conn->fd;
-            pfd.events = (conn->state == STATE_REQ) ? POLLIN : POLLOUT;
+            if (conn->state == STATE_BLOCK)
+                pfd.events = POLLRDHUP; // Only watch for the client going away
+            else
+                pfd.events = (conn->state == STATE_REQ) ? POLLIN : POLLOUT;
             pfd.events |= POLLERR; // Always check for errors
             poll_args.push_back(pfd);
         }
 
         // Wait for events
-        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), 1000); // 1 second timeout
+        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), timeout_ms);
         if (rv < 0)
         {
             die("poll() error");
@@ -1049,7 +3463,7 @@ int main()
                     continue; // Connection not found
 
                 // Handle errors
-                if (poll_args[i].revents & (POLLERR | POLLHUP))
+                if (poll_args[i].revents & (POLLERR | POLLHUP | POLLRDHUP))
                 {
                     conn->state = STATE_END;
                     continue;
@@ -1066,6 +3480,12 @@ int main()
                 }
             }
         }
+
+        // Serve clients blocked on keys that got new members
+        serve_blocked();
+
+        // Log the writes of this iteration before the next poll()
+        aof_flush();
     }
 
     // Cleanup before exiting (this part won't be reached in normal operation)
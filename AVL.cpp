@@ -1,46 +1,95 @@
 #include <cstdint>
+#include <cstddef>
+
+// Intrusive AVL tree, generic over the node type. A node type has the fields of
+// AVLNode, with left/right/parent pointing to its own type; they are declared in
+// each type rather than inherited so that the nodes embedding it stay
+// standard-layout for container_of. The subtree size is always kept; other
+// aggregates are opt-in: avl_update() calls avl_aggregate() for the node type.
 struct AVLNode
 {
-    uint32_t depth = 0; // height of the tree
     uint32_t cnt = 0;   // size of the tree
+    int8_t balance = 0; // height(right) - height(left), within [-1, 1] between calls
     AVLNode *left = nullptr;
     AVLNode *right = nullptr;
     AVLNode *parent = nullptr;
 };
 
-static void avl_init(AVLNode *node)
+// also keeps the sum of val over the tree
+struct AVLSumNode
+{
+    uint32_t cnt = 0;
+    int8_t balance = 0;
+    AVLSumNode *left = nullptr;
+    AVLSumNode *right = nullptr;
+    AVLSumNode *parent = nullptr;
+    double val = 0;
+    double sum = 0;
+};
+
+inline void avl_aggregate(AVLNode *)
 {
-    node->depth = 1;
-    node->cnt = 1;
-    node->left = node->right = node->parent = nullptr;
 }
 
-static uint32_t avl_depth(AVLNode *node)
+inline double avl_val(AVLSumNode *node)
 {
-    return node ? node->depth : 0;
+    return node->val;
 }
 
-static uint32_t avl_cnt(AVLNode *node)
+inline double avl_sum(AVLSumNode *node)
 {
-    return node ? node->cnt : 0;
+    return node ? node->sum : 0;
+}
+
+inline void avl_aggregate(AVLSumNode *node)
+{
+    node->sum = node->val + avl_sum(node->left) + avl_sum(node->right);
 }
 
-static uint32_t max(uint32_t lhs, uint32_t rhs)
+template <class Node>
+static uint32_t avl_cnt(Node *node)
 {
-    return lhs < rhs ? rhs : lhs;
+    return node ? node->cnt : 0;
 }
 
-// maintain the depth and cnt fields
-static void avl_update(AVLNode *node)
+// maintain cnt and the aggregates, the balance is maintained by the callers
+template <class Node>
+static void avl_update(Node *node)
 {
-    node->depth = 1 + max(avl_depth(node->left), avl_depth(node->right));
     node->cnt = 1 + avl_cnt(node->left) + avl_cnt(node->right);
+    avl_aggregate(node);
+}
+
+// a single node tree; the aggregates read the value it is created with
+template <class Node>
+static void avl_init(Node *node)
+{
+    node->balance = 0;
+    node->left = node->right = node->parent = nullptr;
+    avl_update(node);
+}
+
+inline void avl_init(AVLSumNode *node, double val)
+{
+    node->val = val;
+    avl_init(node);
+}
+
+// recompute the aggregates from node up to the root, the shape is unchanged
+template <class Node>
+static void avl_refresh(Node *node)
+{
+    for (; node; node = node->parent)
+    {
+        avl_update(node);
+    }
 }
 
 // LL rotation
-static AVLNode *left_rotation(AVLNode *node)
+template <class Node>
+static Node *left_rotation(Node *node)
 {
-    AVLNode *new_node = node->right;
+    Node *new_node = node->right;
     if (new_node->left)
     {
         new_node->left->parent = node;
@@ -49,15 +98,19 @@ static AVLNode *left_rotation(AVLNode *node)
     new_node->left = node;
     new_node->parent = node->parent;
     node->parent = new_node;
+    // the heights below the two nodes are unchanged, derive the new balances
+    node->balance = node->balance - 1 - (new_node->balance > 0 ? new_node->balance : 0);
+    new_node->balance = new_node->balance - 1 + (node->balance < 0 ? node->balance : 0);
     avl_update(node);
     avl_update(new_node);
     return new_node;
 }
 
 // RR rotation
-static AVLNode *right_rotation(AVLNode *node)
+template <class Node>
+static Node *right_rotation(Node *node)
 {
-    AVLNode *new_node = node->left;
+    Node *new_node = node->left;
     if (new_node->right)
     {
         new_node->right->parent = node;
@@ -66,15 +119,18 @@ static AVLNode *right_rotation(AVLNode *node)
     new_node->right = node;
     new_node->parent = node->parent;
     node->parent = new_node;
+    node->balance = node->balance + 1 - (new_node->balance < 0 ? new_node->balance : 0);
+    new_node->balance = new_node->balance + 1 + (node->balance > 0 ? node->balance : 0);
     avl_update(node);
     avl_update(new_node);
     return new_node;
 }
 
 // LR rotation
-static AVLNode *avl_fix_left(AVLNode *root)
+template <class Node>
+static Node *avl_fix_left(Node *root)
 {
-    if (avl_depth(root->left->left) < avl_depth(root->left->right))
+    if (root->left->balance > 0)
     {
         root->left = left_rotation(root->left);
     }
@@ -83,9 +139,10 @@ static AVLNode *avl_fix_left(AVLNode *root)
 }
 
 // RL rotation
-static AVLNode *avl_fix_right(AVLNode *root)
+template <class Node>
+static Node *avl_fix_right(Node *root)
 {
-    if (avl_depth(root->right->right) < avl_depth(root->right->left))
+    if (root->right->balance < 0)
     {
         root->right = right_rotation(root->right);
     }
@@ -93,97 +150,198 @@ static AVLNode *avl_fix_right(AVLNode *root)
     return left_rotation(root);
 }
 
-static AVLNode *avl_fix(AVLNode *node)
+// rebalance a node whose balance reached +-2, returns the new subtree root
+template <class Node>
+static Node *avl_rebalance(Node *node)
 {
-    while (true)
+    return node->balance < 0 ? avl_fix_left(node) : avl_fix_right(node);
+}
+
+// retrace after linking a new leaf, returns the new root.
+// the balances are only adjusted until the subtree height stops changing,
+// above that point the walk just maintains cnt and sum.
+template <class Node>
+static Node *avl_fix(Node *node)
+{
+    bool grew = true;
+    while (node->parent)
     {
-        avl_update(node);
-        uint32_t l = avl_depth(node->left);
-        uint32_t r = avl_depth(node->right);
-        AVLNode **from = nullptr;
-        if (node->parent)
+        Node *parent = node->parent;
+        Node *up = parent->parent;
+        Node **from = nullptr;
+        if (up)
         {
-            from = (node->parent->left == node) ? &node->parent->left : &node->parent->right;
+            from = (up->left == parent) ? &up->left : &up->right;
         }
 
-        if (l == r + 2)
-        {
-            node = avl_fix_left(node);
-        }
-        else if (l + 2 == r)
+        if (grew)
         {
-            node = avl_fix_right(node);
+            parent->balance += (parent->left == node) ? -1 : 1;
+            if (parent->balance == 0)
+            {
+                grew = false;
+            }
+            else if (parent->balance == 2 || parent->balance == -2)
+            {
+                // an insertion rotation restores the previous height
+                parent = avl_rebalance(parent);
+                grew = false;
+            }
         }
+        avl_update(parent);
 
-        if (!from)
+        if (from)
         {
-            return node;
+            *from = parent;
         }
-        *from = node;
-        node = node->parent;
+        node = parent;
     }
+    return node;
 }
 
-static AVLNode *avl_del(AVLNode *node)
+// detach a node, returns the new root
+template <class Node>
+static Node *avl_del(Node *node)
 {
-    AVLNode *parent = node->parent;
+    Node *parent = nullptr; // where the retracing starts
+    bool from_left = false;    // the side of parent that lost a level
 
-    if (node->right == nullptr)
+    if (node->left && node->right)
     {
-        // no right subtree, replace the node with the left subtree
-        // link the left subtree to the parent
-        if (node->left)
+        // the successor takes the place of the node
+        Node *victim = node->right;
+        while (victim->left)
         {
-            node->left->parent = parent;
+            victim = victim->left;
         }
-        if (parent)
+        if (victim->parent == node)
         {
-            // attach the left subtree to the parent
-            (parent->left == node ? parent->left : parent->right) = node->left;
-            return avl_fix(parent);
+            parent = victim;
+            from_left = false;
         }
         else
         {
-            // removing root
-            return node->left;
+            parent = victim->parent;
+            from_left = true;
+            parent->left = victim->right;
+            if (victim->right)
+            {
+                victim->right->parent = parent;
+            }
+            victim->right = node->right;
+            victim->right->parent = victim;
+        }
+        victim->left = node->left;
+        victim->left->parent = victim;
+        victim->balance = node->balance;
+        victim->parent = node->parent;
+        if (node->parent)
+        {
+            (node->parent->left == node ? node->parent->left : node->parent->right) = victim;
         }
     }
     else
     {
-        // swap the node with its right sibling
-        AVLNode *victim = node->right;
-        while (victim->left)
+        // at most one child, link it to the parent
+        Node *child = node->left ? node->left : node->right;
+        parent = node->parent;
+        if (child)
         {
-            victim = victim->left;
+            child->parent = parent;
         }
-        AVLNode *root = avl_del(victim);
-        *victim = *node;
-        if (victim->left)
+        if (!parent)
         {
-            victim->left->parent = victim;
+            // removing root
+            return child;
         }
-        if (victim->right)
+        from_left = (parent->left == node);
+        (from_left ? parent->left : parent->right) = child;
+    }
+
+    bool shrunk = true;
+    while (true)
+    {
+        Node *up = parent->parent;
+        Node **from = nullptr;
+        bool up_left = false;
+        if (up)
         {
-            victim->right->parent = victim;
+            up_left = (up->left == parent);
+            from = up_left ? &up->left : &up->right;
         }
 
-        AVLNode *parent = node->parent;
+        if (shrunk)
+        {
+            parent->balance += from_left ? 1 : -1;
+            if (parent->balance == 1 || parent->balance == -1)
+            {
+                // was even, the height is unchanged
+                shrunk = false;
+            }
+            else if (parent->balance == 2 || parent->balance == -2)
+            {
+                // with an even sibling the rotation keeps the height
+                Node *sibling = parent->balance > 0 ? parent->right : parent->left;
+                shrunk = (sibling->balance != 0);
+                parent = avl_rebalance(parent);
+            }
+        }
+        avl_update(parent);
 
-        if (parent)
+        if (!from)
         {
-            (parent->left == node ? parent->left : parent->right) = victim;
-            return root;
+            return parent;
         }
-        else
+        *from = parent;
+        from_left = up_left;
+        parent = up;
+    }
+}
+
+// in-order successor, walks at most one root-to-leaf path
+template <class Node>
+static Node *avl_next(Node *node)
+{
+    if (node->right)
+    {
+        node = node->right;
+        while (node->left)
+        {
+            node = node->left;
+        }
+        return node;
+    }
+    while (node->parent && node->parent->right == node)
+    {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+// in-order predecessor
+template <class Node>
+static Node *avl_prev(Node *node)
+{
+    if (node->left)
+    {
+        node = node->left;
+        while (node->right)
         {
-            return victim;
+            node = node->right;
         }
+        return node;
+    }
+    while (node->parent && node->parent->left == node)
+    {
+        node = node->parent;
     }
+    return node->parent;
 }
 
 // offset into the succeeding or preceding node.
 // note: the worst-case is O(log(n)) regardless of how long the offset is.
-AVLNode *avl_offset(AVLNode *node, int64_t offset)
+template <class Node>
+static Node *avl_offset(Node *node, int64_t offset)
 {
     int64_t pos = 0; // relative to the starting node
     while (offset != pos)
@@ -203,7 +361,7 @@ AVLNode *avl_offset(AVLNode *node, int64_t offset)
         else
         {
             // go to the parent
-            AVLNode *parent = node->parent;
+            Node *parent = node->parent;
             if (!parent)
             {
                 return nullptr;
@@ -221,3 +379,71 @@ AVLNode *avl_offset(AVLNode *node, int64_t offset)
     }
     return node;
 }
+
+// height of a tree of n nodes built by avl_build(): the bit width of n
+inline int avl_build_height(size_t n)
+{
+    int h = 0;
+    for (; n; n >>= 1)
+    {
+        h++;
+    }
+    return h;
+}
+
+// build a perfectly balanced tree from nodes already in sorted order.
+// the recursion depth is O(log(n)), every node is visited once.
+template <class Node>
+static Node *avl_build(Node **nodes, size_t n, Node *parent = nullptr)
+{
+    if (n == 0)
+    {
+        return nullptr;
+    }
+    size_t mid = n / 2;
+    Node *node = nodes[mid];
+    node->parent = parent;
+    node->left = avl_build(nodes, mid, node);
+    node->right = avl_build(nodes + mid + 1, n - mid - 1, node);
+    node->balance = (int8_t)(avl_build_height(n - mid - 1) - avl_build_height(mid));
+    avl_update(node);
+    return node;
+}
+
+// number of nodes preceding this one
+template <class Node>
+static int64_t avl_rank(Node *node)
+{
+    int64_t rank = avl_cnt(node->left);
+    for (; node->parent; node = node->parent)
+    {
+        if (node->parent->right == node)
+        {
+            rank += avl_cnt(node->parent->left) + 1;
+        }
+    }
+    return rank;
+}
+
+// sum of avl_val() over the nodes ranked [lo, hi] in this subtree, for node
+// types that keep a sum.
+// only the two boundary paths are descended, so this is O(log(n)).
+template <class Node>
+static double avl_sum_rank(Node *node, int64_t lo, int64_t hi)
+{
+    if (!node || hi < 0 || lo >= (int64_t)node->cnt || lo > hi)
+    {
+        return 0;
+    }
+    if (lo <= 0 && hi >= (int64_t)node->cnt - 1)
+    {
+        return node->sum;
+    }
+    int64_t l = avl_cnt(node->left);
+    double rv = avl_sum_rank(node->left, lo, hi);
+    if (lo <= l && l <= hi)
+    {
+        rv += avl_val(node);
+    }
+    return rv + avl_sum_rank(node->right, lo - l - 1, hi - l - 1);
+}
@@ -0,0 +1,73 @@
+#include "aof.h"
+#include "crc32c.h"
+#include <cstring>
+
+void aof_put_block(std::string &out, const char *data, size_t size)
+{
+    uint32_t len = (uint32_t)size;
+    uint32_t crc = crc32c(0, data, size);
+    out.append((const char *)&len, 4);
+    out.append((const char *)&crc, 4);
+    out.append(data, size);
+}
+
+bool aof_has_magic(const char *data, size_t size)
+{
+    return size >= sizeof(k_aof_magic) && memcmp(data, k_aof_magic, sizeof(k_aof_magic)) == 0;
+}
+
+int aof_next_block(const char *data, size_t size, size_t *pos, const char **payload, uint32_t *len)
+{
+    if (*pos == size)
+    {
+        return AOF_BLOCK_END;
+    }
+    if (size - *pos < k_aof_block_head)
+    {
+        return AOF_BLOCK_PARTIAL;
+    }
+    uint32_t crc = 0;
+    memcpy(len, data + *pos, 4);
+    memcpy(&crc, data + *pos + 4, 4);
+    if (size - *pos - k_aof_block_head < *len)
+    {
+        return AOF_BLOCK_PARTIAL;
+    }
+    const char *p = data + *pos + k_aof_block_head;
+    if (crc32c(0, p, *len) != crc)
+    {
+        return AOF_BLOCK_BAD_CRC;
+    }
+    for (size_t off = 0; off < *len;)
+    {
+        uint32_t rlen = 0;
+        if (*len - off < 4)
+        {
+            return AOF_BLOCK_BAD_REQUEST;
+        }
+        memcpy(&rlen, p + off, 4);
+        if (*len - off - 4 < rlen)
+        {
+            return AOF_BLOCK_BAD_REQUEST;
+        }
+        off += 4 + rlen;
+    }
+    *payload = p;
+    *pos += k_aof_block_head + *len;
+    return AOF_BLOCK_OK;
+}
+
+const char *aof_block_error(int rv)
+{
+    switch (rv)
+    {
+    case AOF_BLOCK_PARTIAL:
+        return "the file ends inside a block";
+    case AOF_BLOCK_BAD_CRC:
+        return "block does not match its checksum";
+    case AOF_BLOCK_BAD_REQUEST:
+        return "block holds a partial request";
+    default:
+        return "no error";
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// Append-only file layout. Integers are little-endian, as in the wire protocol.
+//
+//   header  "BRAOF001"
+//   blocks  u32 payload size, u32 CRC-32C of the payload, then the payload:
+//           whole requests in the wire format (u32 length, then the body)
+//
+// The server writes one block per event loop iteration, a rewrite one block
+// per k_snap_buf bytes of commands.
+
+const char k_aof_magic[8] = {'B', 'R', 'A', 'O', 'F', '0', '0', '1'};
+const size_t k_aof_block_head = 8;
+
+enum
+{
+    AOF_BLOCK_OK,
+    AOF_BLOCK_END,     // no more data
+    AOF_BLOCK_PARTIAL, // the file ends inside the block: a write cut short
+    AOF_BLOCK_BAD_CRC,
+    AOF_BLOCK_BAD_REQUEST, // the payload is not a whole number of requests
+};
+
+void aof_put_block(std::string &out, const char *data, size_t size);
+bool aof_has_magic(const char *data, size_t size);
+// check the block at *pos; on AOF_BLOCK_OK return its payload and move *pos past it
+int aof_next_block(const char *data, size_t size, size_t *pos, const char **payload, uint32_t *len);
+const char *aof_block_error(int rv);
@@ -115,6 +115,15 @@ static bool del(Container &c, uint32_t val) {
     return true;
 }
 
+static uint32_t height(AVLNode *node) {
+    if (!node) {
+        return 0;
+    }
+    uint32_t l = height(node->left);
+    uint32_t r = height(node->right);
+    return 1 + (l < r ? r : l);
+}
+
 static void avl_verify(AVLNode *parent, AVLNode *node) {
     if (!node) return;
 
@@ -124,10 +133,10 @@ static void avl_verify(AVLNode *parent, AVLNode *node) {
 
     assert(node->cnt == 1 + avl_cnt(node->left) + avl_cnt(node->right));
 
-    uint32_t l = avl_depth(node->left);
-    uint32_t r = avl_depth(node->right);
+    uint32_t l = height(node->left);
+    uint32_t r = height(node->right);
     assert(l == r || l+1 == r || l == r+1);
-    assert(node->depth == 1 + max(l, r));
+    assert(node->balance == (int)r - (int)l);
 
     uint32_t val = container_of(node, Data, node)->val;
     if (node->left) {
@@ -249,9 +258,9 @@ void test_break_count_property() {
     container_verify(c, ref);
 }
 
-// Test that breaks depth property
+// Test that breaks the balance factor
 void test_break_depth_property() {
-    std::cout << "Breaking depth property..." << std::endl;
+    std::cout << "Breaking balance factor..." << std::endl;
     Container c;
     std::multiset<uint32_t> ref;
     
@@ -262,10 +271,10 @@ void test_break_depth_property() {
     ref.insert(5);
     ref.insert(15);
     
-    // Corrupt depth
-    c.root->depth = 10; // Should be 2
+    // Corrupt balance
+    c.root->balance = 1; // Should be 0
     
-    // This should fail depth check
+    // This should fail balance check
     container_verify(c, ref);
 }
 
@@ -297,7 +306,7 @@ int main() {
     try {
         test_break_depth_property();
     } catch (const std::exception& e) {
-        std::cout << "Test failed as expected: Depth property violated\n";
+        std::cout << "Test failed as expected: Balance factor violated\n";
     }
 
     std::cout << "All tests completed\n";
@@ -0,0 +1,117 @@
+// Insert/delete cost of the zset and of its bare AVL tree, with std::set as a reference.
+// bench_tree() only uses avl_init/avl_fix/avl_del; for a before/after comparison against
+// AVL.cpp revisions without AVLSumNode, rename it back to AVLNode.
+// usage: bench_avl [members]   (default 10M)
+#include "AVL.cpp"
+#include "hashtable.cpp"
+#include "zset.cpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+static double now_sec() {
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void report(const char *name, const char *op, size_t n, double secs) {
+    printf("%-10s %-7s %10zu ops %8.1f ns/op %12.0f ops/sec\n",
+           name, op, n, secs * 1e9 / n, n / secs);
+}
+
+static void bench_zset(const std::vector<std::string> &names, const std::vector<uint32_t> &scores,
+                       const std::vector<size_t> &order) {
+    Zset zset;
+    double t0 = now_sec();
+    for (size_t i = 0; i < names.size(); ++i) {
+        zset_add(&zset, names[i].data(), names[i].size(), scores[i]);
+    }
+    double t1 = now_sec();
+    for (size_t i : order) {
+        Znode *node = zset_lookup(&zset, names[i].data(), names[i].size());
+        zset_delete(&zset, node);
+    }
+    double t2 = now_sec();
+    assert(!zset_size(&zset));
+    zset_dispose(&zset);
+    report("zset", "insert", names.size(), t1 - t0);
+    report("zset", "delete", names.size(), t2 - t1);
+}
+
+// the tree alone, without the member hashtable or the name comparisons
+static void bench_tree(const std::vector<uint32_t> &scores, const std::vector<size_t> &order) {
+    std::vector<AVLSumNode> nodes(scores.size());
+    AVLSumNode *root = nullptr;
+    double t0 = now_sec();
+    for (size_t i = 0; i < scores.size(); ++i) {
+        AVLSumNode *node = &nodes[i];
+        avl_init(node, scores[i]);
+        if (!root) {
+            root = node;
+            continue;
+        }
+        AVLSumNode *curr = root;
+        while (true) {
+            AVLSumNode **from = (node->val < curr->val) ? &curr->left : &curr->right;
+            if (!*from) {
+                *from = node;
+                node->parent = curr;
+                root = avl_fix(node);
+                break;
+            }
+            curr = *from;
+        }
+    }
+    double t1 = now_sec();
+    for (size_t i : order) {
+        root = avl_del(&nodes[i]);
+    }
+    double t2 = now_sec();
+    assert(!root);
+    report("AVLNode", "insert", scores.size(), t1 - t0);
+    report("AVLNode", "delete", scores.size(), t2 - t1);
+}
+
+static void bench_stdset(const std::vector<std::string> &names, const std::vector<uint32_t> &scores,
+                         const std::vector<size_t> &order) {
+    std::set<std::pair<double, std::string>> set;
+    double t0 = now_sec();
+    for (size_t i = 0; i < names.size(); ++i) {
+        set.emplace(scores[i], names[i]);
+    }
+    double t1 = now_sec();
+    for (size_t i : order) {
+        set.erase(std::make_pair((double)scores[i], names[i]));
+    }
+    double t2 = now_sec();
+    report("std::set", "insert", names.size(), t1 - t0);
+    report("std::set", "delete", names.size(), t2 - t1);
+}
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? strtoull(argv[1], nullptr, 10) : 10 * 1000 * 1000;
+
+    // distinct scores, so every tree can delete by value
+    std::vector<uint32_t> scores(n);
+    std::vector<std::string> names(n);
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; ++i) {
+        scores[i] = (uint32_t)i;
+        names[i] = "member:" + std::to_string(i);
+        order[i] = i;
+    }
+    srand(1);
+    for (size_t i = n; i > 1; --i) {
+        std::swap(scores[i - 1], scores[(size_t)rand() % i]);
+        std::swap(order[i - 1], order[(size_t)rand() % i]);
+    }
+
+    bench_zset(names, scores, order);
+    bench_tree(scores, order);
+    bench_stdset(names, scores, order);
+    return 0;
+}
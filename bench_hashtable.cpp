@@ -0,0 +1,207 @@
+// Throughput and per-operation latency of the HMap in hashtable.cpp.
+// For every (key count, key length) pair it inserts all keys, looks each one up,
+// looks up as many absent keys, then pops every key, each in a random order.
+// Every operation is timed on its own and filed under the state of the map when
+// it started, so the tail cost of resizing shows up separately:
+//   all       every operation of the pass
+//   steady    no resize in progress
+//   resizing  ht2 is being drained by hm_help_resizing()
+//   start     the insert that triggered hm_start_resizing() (calloc of the new table)
+// Output is CSV on stdout, one row per (keys, key_len, op, phase). hist is a
+// log2 histogram of latencies: the i-th count is for [2^i, 2^(i+1)) ns.
+// ops_per_sec is the row's ops over their summed latency; clock reads (~20ns)
+// are not subtracted.
+// usage: bench_hashtable [keys,...] [key_len,...]
+//        (default 1000,10000,100000,1000000 and 8,32,256; 100M keys need ~8GB at key_len 8)
+#include "hashtable.cpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+const int k_hist_buckets = 40;
+
+struct BKey {
+    HNode node;
+    const char *key = nullptr;
+    uint32_t len = 0;
+};
+
+struct Latency {
+    std::vector<float> ns;
+    uint64_t hist[k_hist_buckets] = {};
+    double total_ns = 0;
+
+    void add(int64_t t) {
+        ns.push_back((float)t);
+        total_ns += t;
+        int b = 0;
+        while (b + 1 < k_hist_buckets && (int64_t(2) << b) <= t) {
+            b++;
+        }
+        hist[b]++;
+    }
+};
+
+enum { PHASE_ALL, PHASE_STEADY, PHASE_RESIZING, PHASE_START, PHASE_MAX };
+static const char *k_phase_names[PHASE_MAX] = {"all", "steady", "resizing", "start"};
+
+// file one latency under its phase and under the pass total
+static void record(Latency *lat, int phase, int64_t t) {
+    lat[PHASE_ALL].add(t);
+    lat[phase].add(t);
+}
+
+static int64_t now_ns() {
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static bool bkey_eq(HNode *lhs, HNode *rhs) {
+    BKey *l = container_of(lhs, BKey, node);
+    BKey *r = container_of(rhs, BKey, node);
+    return l->len == r->len && memcmp(l->key, r->key, l->len) == 0;
+}
+
+static bool resizing(HMap *hmap) {
+    return hmap->ht2.tab != nullptr;
+}
+
+static void print_row(size_t keys, size_t len, const char *op, const char *phase, Latency &lat) {
+    if (lat.ns.empty()) {
+        return;
+    }
+    std::vector<float> &ns = lat.ns;
+    std::sort(ns.begin(), ns.end());
+    auto pct = [&](double p) { return ns[std::min(ns.size() - 1, (size_t)(p * ns.size()))]; };
+    int top = k_hist_buckets - 1;
+    while (top > 0 && !lat.hist[top]) {
+        top--;
+    }
+    std::string hist;
+    for (int b = 0; b <= top; ++b) {
+        hist += (b ? ";" : "") + std::to_string(lat.hist[b]);
+    }
+    printf("%zu,%zu,%s,%s,%zu,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%s\n", keys, len, op, phase,
+           ns.size(), lat.total_ns > 0 ? ns.size() / (lat.total_ns * 1e-9) : 0.0, pct(0.5), pct(0.99), pct(0.999),
+           pct(0.9999), ns.back(), hist.c_str());
+}
+
+static std::vector<size_t> parse_list(const char *arg) {
+    std::vector<size_t> out;
+    for (const char *p = arg; *p;) {
+        char *end = nullptr;
+        out.push_back(strtoull(p, &end, 10));
+        p = (*end == ',') ? end + 1 : end;
+        if (end == p && *p) {
+            break;  // not a number
+        }
+    }
+    return out;
+}
+
+static void bench(size_t n, size_t len, std::mt19937_64 &rng) {
+    // keys 0..n-1 are inserted, n..2n-1 are only used for misses.
+    // the index is spelled in the first bytes, the rest is filler.
+    std::vector<char> bytes(2 * n * len);
+    std::vector<BKey> keys(2 * n);
+    for (size_t i = 0; i < 2 * n; ++i) {
+        char *k = &bytes[i * len];
+        memset(k, 'k', len);
+        uint64_t v = i;
+        for (size_t j = 0; j < len && j < 16; ++j, v >>= 4) {
+            k[j] = "0123456789abcdef"[v & 15];
+        }
+        keys[i].key = k;
+        keys[i].len = (uint32_t)len;
+        keys[i].node.hcode = str_hash((const uint8_t *)k, len);
+    }
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; ++i) {
+        order[i] = i;
+    }
+
+    HMap hmap;
+    Latency ins[PHASE_MAX];
+    std::shuffle(order.begin(), order.end(), rng);
+    for (size_t i : order) {
+        bool was_resizing = resizing(&hmap);
+        void *ht1 = hmap.ht1.tab;
+        int64_t t0 = now_ns();
+        hm_insert(&hmap, &keys[i].node);
+        int64_t t1 = now_ns();
+        int phase = was_resizing ? PHASE_RESIZING : PHASE_STEADY;
+        if (hmap.ht1.tab != ht1 && ht1) {
+            phase = PHASE_START;  // the old table moved to ht2
+        }
+        record(ins, phase, t1 - t0);
+    }
+    for (int p = 0; p < PHASE_MAX; ++p) {
+        print_row(n, len, "insert", k_phase_names[p], ins[p]);
+    }
+
+    struct Pass {
+        const char *op;
+        size_t base;  // index of the first key used
+    };
+    Pass lookups[] = {{"lookup", 0}, {"miss", n}};
+    for (const Pass &pass : lookups) {
+        Latency lat[PHASE_MAX];
+        std::shuffle(order.begin(), order.end(), rng);
+        size_t found = 0;
+        for (size_t i : order) {
+            bool was_resizing = resizing(&hmap);
+            int64_t t0 = now_ns();
+            HNode *node = hm_lookup(&hmap, &keys[pass.base + i].node, &bkey_eq);
+            int64_t t1 = now_ns();
+            found += (node != nullptr);
+            record(lat, was_resizing ? PHASE_RESIZING : PHASE_STEADY, t1 - t0);
+        }
+        if (found != (pass.base ? 0 : n)) {
+            fprintf(stderr, "FAIL: %s found %zu of %zu keys\n", pass.op, found, n);
+            exit(1);
+        }
+        for (int p = 0; p < PHASE_MAX; ++p) {
+            print_row(n, len, pass.op, k_phase_names[p], lat[p]);
+        }
+    }
+
+    Latency pop[PHASE_MAX];
+    std::shuffle(order.begin(), order.end(), rng);
+    for (size_t i : order) {
+        bool was_resizing = resizing(&hmap);
+        int64_t t0 = now_ns();
+        HNode *node = hm_pop(&hmap, &keys[i].node, &bkey_eq);
+        int64_t t1 = now_ns();
+        if (node != &keys[i].node) {
+            fprintf(stderr, "FAIL: pop of key %zu\n", i);
+            exit(1);
+        }
+        record(pop, was_resizing ? PHASE_RESIZING : PHASE_STEADY, t1 - t0);
+    }
+    for (int p = 0; p < PHASE_MAX; ++p) {
+        print_row(n, len, "pop", k_phase_names[p], pop[p]);
+    }
+    free(hmap.ht1.tab);
+    free(hmap.ht2.tab);
+}
+
+int main(int argc, char **argv) {
+    std::vector<size_t> counts = parse_list(argc > 1 ? argv[1] : "1000,10000,100000,1000000");
+    std::vector<size_t> lens = parse_list(argc > 2 ? argv[2] : "8,32,256");
+    std::mt19937_64 rng(1);
+    printf("keys,key_len,op,phase,ops,ops_per_sec,p50_ns,p99_ns,p999_ns,p9999_ns,max_ns,hist\n");
+    for (size_t n : counts) {
+        for (size_t len : lens) {
+            if (n && len) {
+                bench(n, len, rng);
+                fflush(stdout);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,291 @@
+// Randomized differential stress and benchmark of the zset layer.
+// Drives zset_add/zset_update/zset_delete/zset_at/zset_query/zset_seek_score
+// with a random mix of operations, checks every result against a std::multiset
+// of (score, name) and reports throughput and latency percentiles per operation.
+// Only the zset call is timed, the reference and the checks are not.
+// Then a fresh set of [members] is built with zset_add to report the heap bytes
+// per member, nodes and member table included, as counted by glibc malloc.
+// Names are "member:N" (str), decimal int64s (int), or decimal int64s with a
+// "member:N" name every 16 ids and fractional scores from the midpoint on
+// (mixed), which converts the set while it is under test.
+// usage: bench_zset [ops] [members] [seed] [str|int|mixed]   (default 2M ops over 1M members, str)
+#include "hashtable.cpp"
+#include "zset.cpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <malloc.h>
+#include <random>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+typedef std::multiset<std::pair<double, std::string>> RefSet;
+
+enum {
+    OP_INSERT, OP_UPDATE, OP_DELETE, OP_RANK, OP_QUERY, OP_RANGE, OP_MAX,
+};
+
+static const char *k_op_names[OP_MAX] = {
+    "insert", "update", "delete", "rank", "query", "range",
+};
+
+const int k_range_len = 100;  // members read by each range scan
+const int k_query_span = 50;  // zset_query offsets are drawn from [-span, span]
+
+struct OpStats {
+    std::vector<float> ns;
+};
+
+static std::vector<OpStats> g_stats(OP_MAX);
+
+static int64_t now_ns() {
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void check(bool ok, const char *what, uint64_t op) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s at op %llu\n", what, (unsigned long long)op);
+        exit(1);
+    }
+}
+
+static std::string member_of(const Zset *zset, const Znode *node) {
+    ZMember member;
+    znode_member(zset, node, &member);
+    return std::string(member.name, member.len);
+}
+
+static bool same(const Zset *zset, Znode *node, const RefSet::iterator &it, const RefSet &ref) {
+    if (it == ref.end()) {
+        return node == NULL;
+    }
+    return node && znode_score(zset, node) == it->first && member_of(zset, node) == it->second;
+}
+
+// the whole set, in order, against the reference
+static void verify_all(Zset *zset, const RefSet &ref, uint64_t op) {
+    check(zset_size(zset) == ref.size(), "size", op);
+    check(zset_at(zset, (int64_t)ref.size()) == NULL, "tree size", op);
+    Znode *node = zset_first(zset);
+    for (RefSet::iterator it = ref.begin(); it != ref.end(); ++it) {
+        check(same(zset, node, it, ref), "in-order walk", op);
+        node = znode_next(zset, node);
+    }
+    check(node == NULL, "walk past the end", op);
+}
+
+static void report(int op, double secs) {
+    std::vector<float> &ns = g_stats[op].ns;
+    if (ns.empty()) {
+        return;
+    }
+    std::sort(ns.begin(), ns.end());
+    auto pct = [&](double p) { return ns[std::min(ns.size() - 1, (size_t)(p * ns.size()))]; };
+    printf("%-7s %10zu ops %12.0f ops/sec  p50 %6.0f  p90 %6.0f  p99 %6.0f  p99.9 %7.0f  max %9.0f ns\n",
+           k_op_names[op], ns.size(), ns.size() / secs, pct(0.5), pct(0.9), pct(0.99), pct(0.999), ns.back());
+}
+
+static void report_memory(const std::vector<std::string> &names, size_t nmembers) {
+    size_t n = std::min(nmembers, names.size());
+    // large blocks are mmap()ed, and a node buffer past the threshold is one
+    struct mallinfo2 mi = mallinfo2();
+    size_t before = mi.uordblks + mi.hblkhd;
+    Zset *zset = new Zset();
+    for (size_t i = 0; i < n; ++i) {
+        zset_add(zset, names[i].data(), names[i].size(), (double)(i % 1000));
+    }
+    mi = mallinfo2();
+    size_t after = mi.uordblks + mi.hblkhd;
+    printf("memory  %10zu members %9.1f heap bytes/member  (sizeof(Znode) %zu, names of %zu bytes)\n", n,
+           n ? (double)(after - before) / n : 0.0, sizeof(Znode), names.empty() ? (size_t)0 : names[n / 2].size());
+    zset_dispose(zset);
+    delete zset;
+}
+
+int main(int argc, char **argv) {
+    uint64_t nops = argc > 1 ? strtoull(argv[1], nullptr, 10) : 2 * 1000 * 1000;
+    size_t nmembers = argc > 2 ? strtoull(argv[2], nullptr, 10) : 1000 * 1000;
+    uint64_t seed = argc > 3 ? strtoull(argv[3], nullptr, 10) : 1;
+    std::string mode = argc > 4 ? argv[4] : "str";
+    if (mode != "str" && mode != "int" && mode != "mixed") {
+        fprintf(stderr, "usage: bench_zset [ops] [members] [seed] [str|int|mixed]\n");
+        return 1;
+    }
+    std::mt19937_64 rng(seed);
+
+    // ids are drawn from twice the target size, so about half of them are present
+    size_t nids = std::max<size_t>(2 * nmembers, 2);
+    std::vector<std::string> names(nids);
+    for (size_t i = 0; i < nids; ++i) {
+        if (mode == "str" || (mode == "mixed" && i % 16 == 0)) {
+            names[i] = "member:" + std::to_string(i);
+        } else {
+            // distinct, spread over both signs
+            names[i] = std::to_string((int64_t)(i * 2654435761ull % 4294967311ull) - 2147483655);
+        }
+    }
+    if (mode == "int") {
+        names[0] = std::to_string(INT64_MIN);
+        names[1] = std::to_string(INT64_MAX);
+    }
+    uint64_t midpoint = mode == "mixed" ? nops / 2 : nops;
+    std::vector<double> score_of(nids, NAN);
+    std::vector<int64_t> slot_of(nids, -1);  // position in present[]
+    std::vector<uint32_t> present;
+    // integral scores in a narrow range, so ties are broken by name
+    std::uniform_int_distribution<int> score_dist(0, (int)std::max<size_t>(nmembers / 4, 1));
+
+    Zset zset;
+    RefSet ref;
+    double secs[OP_MAX] = {};
+    uint64_t checkpoint = std::max<uint64_t>(nops / 4, 1);
+
+    for (uint64_t op = 0; op < nops; ++op) {
+        // insert more often while the set is below its target size
+        uint32_t dice = (uint32_t)(rng() % 100);
+        int kind;
+        if (present.empty() || dice < (present.size() < nmembers ? 35u : 20u)) {
+            kind = OP_INSERT;
+        } else if (dice < 45) {
+            kind = OP_UPDATE;
+        } else if (dice < 60) {
+            kind = OP_DELETE;
+        } else if (dice < 75) {
+            kind = OP_RANK;
+        } else if (dice < 90) {
+            kind = OP_QUERY;
+        } else {
+            kind = OP_RANGE;
+        }
+
+        int64_t t0 = 0, t1 = 0;
+        if (kind == OP_INSERT) {
+            uint32_t id = (uint32_t)(rng() % nids);
+            if (op < midpoint && id % 16 == 0 && mode == "mixed") {
+                id++;  // string names only after the midpoint
+            }
+            double score = score_dist(rng);
+            if (op >= midpoint && rng() % 8 == 0) {
+                score += 0.5;
+            }
+            const std::string &name = names[id];
+            t0 = now_ns();
+            bool added = zset_add(&zset, name.data(), name.size(), score);
+            t1 = now_ns();
+            check(added == (slot_of[id] < 0), "zset_add result", op);
+            if (!added) {
+                kind = OP_UPDATE;  // an existing member, reported as an update
+                ref.erase(ref.find(std::make_pair(score_of[id], name)));
+            } else {
+                slot_of[id] = (int64_t)present.size();
+                present.push_back(id);
+            }
+            score_of[id] = score;
+            ref.emplace(score, name);
+        } else if (kind == OP_UPDATE) {
+            uint32_t id = present[rng() % present.size()];
+            const std::string &name = names[id];
+            double score = score_dist(rng);
+            if (op >= midpoint && rng() % 8 == 0) {
+                score += 0.5;
+            }
+            Znode *node = zset_lookup(&zset, name.data(), name.size());
+            check(node != NULL, "zset_lookup", op);
+            t0 = now_ns();
+            zset_update(&zset, node, score);
+            t1 = now_ns();
+            ref.erase(ref.find(std::make_pair(score_of[id], name)));
+            ref.emplace(score, name);
+            score_of[id] = score;
+            check(znode_score(&zset, node) == score, "zset_update score", op);
+        } else if (kind == OP_DELETE) {
+            uint32_t id = present[rng() % present.size()];
+            const std::string &name = names[id];
+            t0 = now_ns();
+            Znode *node = zset_lookup(&zset, name.data(), name.size());
+            if (node) {
+                zset_delete(&zset, node);
+            }
+            t1 = now_ns();
+            check(node != NULL, "zset_lookup before delete", op);
+            check(zset_lookup(&zset, name.data(), name.size()) == NULL, "lookup after delete", op);
+            ref.erase(ref.find(std::make_pair(score_of[id], name)));
+            int64_t slot = slot_of[id];
+            present[slot] = present.back();
+            slot_of[present[slot]] = slot;
+            present.pop_back();
+            slot_of[id] = -1;
+            score_of[id] = NAN;
+        } else if (kind == OP_RANK) {
+            int64_t rank = (int64_t)(rng() % present.size());
+            t0 = now_ns();
+            Znode *node = zset_at(&zset, rank);
+            t1 = now_ns();
+            check(node != NULL, "zset_at", op);
+            check(zset_rank(&zset, node) == rank, "zset_rank of zset_at", op);
+            RefSet::iterator it = ref.find(std::make_pair(znode_score(&zset, node), member_of(&zset, node)));
+            check(it != ref.end(), "zset_at member in reference", op);
+            // the neighbours pin down the position in the reference order
+            RefSet::iterator next = std::next(it);
+            check(same(&zset, znode_next(&zset, node), next, ref), "zset_at successor", op);
+            check(it == ref.begin() ? znode_prev(&zset, node) == NULL : same(&zset, znode_prev(&zset, node), std::prev(it), ref),
+                  "zset_at predecessor", op);
+        } else if (kind == OP_QUERY) {
+            uint32_t id = present[rng() % present.size()];
+            const std::string &name = names[id];
+            int64_t offset = (int64_t)(rng() % (2 * k_query_span + 1)) - k_query_span;
+            t0 = now_ns();
+            Znode *node = zset_query(&zset, score_of[id], name.data(), name.size(), offset);
+            t1 = now_ns();
+            RefSet::iterator it = ref.find(std::make_pair(score_of[id], name));
+            int64_t i = 0;
+            for (; i < offset && it != ref.end(); ++i) {
+                ++it;
+            }
+            for (; i > offset && it != ref.begin(); --i) {
+                --it;
+            }
+            if (i != offset) {
+                check(node == NULL, "zset_query before the first member", op);
+            } else {
+                check(same(&zset, node, it, ref), "zset_query", op);
+            }
+        } else {
+            double score = score_dist(rng);
+            Znode *got[k_range_len];
+            int n = 0;
+            t0 = now_ns();
+            ZIter iter = {&zset, zset_seek_score(&zset, score, true), false};
+            while (n < k_range_len && (got[n] = ziter_next(&iter))) {
+                n++;
+            }
+            t1 = now_ns();
+            RefSet::iterator it = ref.lower_bound(std::make_pair(score, std::string()));
+            for (int i = 0; i < n; ++i, ++it) {
+                check(same(&zset, got[i], it, ref), "range scan", op);
+            }
+            check(n == k_range_len || it == ref.end(), "range scan length", op);
+        }
+
+        g_stats[kind].ns.push_back((float)(t1 - t0));
+        secs[kind] += (t1 - t0) * 1e-9;
+        if ((op + 1) % checkpoint == 0) {
+            verify_all(&zset, ref, op);
+        }
+    }
+
+    verify_all(&zset, ref, nops);
+    printf("%llu ops, %zu members at the end, seed %llu, %s names, all results match std::multiset\n",
+           (unsigned long long)nops, ref.size(), (unsigned long long)seed, mode.c_str());
+    for (int op = 0; op < OP_MAX; ++op) {
+        report(op, secs[op]);
+    }
+    zset_dispose(&zset);
+    report_memory(names, nmembers);
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include "crc32c.h"
+#include <cstring>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+const uint32_t k_crc32c_poly = 0x82f63b78; // reflected Castagnoli polynomial
+
+// slicing-by-8 tables: table[k][b] is the CRC of byte b followed by k zero bytes
+static uint32_t g_crc32c_table[8][256];
+
+static void crc32c_init_table()
+{
+    for (uint32_t b = 0; b < 256; ++b)
+    {
+        uint32_t crc = b;
+        for (int i = 0; i < 8; ++i)
+        {
+            crc = (crc >> 1) ^ (k_crc32c_poly & (0u - (crc & 1)));
+        }
+        g_crc32c_table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; ++b)
+    {
+        for (int k = 1; k < 8; ++k)
+        {
+            uint32_t prev = g_crc32c_table[k - 1][b];
+            g_crc32c_table[k][b] = (prev >> 8) ^ g_crc32c_table[0][prev & 0xff];
+        }
+    }
+}
+
+// portable fallback, 8 bytes per step
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len >= 8)
+    {
+        uint64_t v = 0;
+        memcpy(&v, p, 8);
+        v ^= crc; // little-endian: the CRC lines up with the first 4 bytes
+        crc = g_crc32c_table[7][v & 0xff] ^ g_crc32c_table[6][(v >> 8) & 0xff] ^
+              g_crc32c_table[5][(v >> 16) & 0xff] ^ g_crc32c_table[4][(v >> 24) & 0xff] ^
+              g_crc32c_table[3][(v >> 32) & 0xff] ^ g_crc32c_table[2][(v >> 40) & 0xff] ^
+              g_crc32c_table[1][(v >> 48) & 0xff] ^ g_crc32c_table[0][v >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+    {
+        crc = (crc >> 8) ^ g_crc32c_table[0][(crc ^ *p++) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// the crc32 instruction, 8 bytes per instruction
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t c = crc;
+    while (len >= 8)
+    {
+        uint64_t v = 0;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+    {
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+    }
+    return (uint32_t)c;
+}
+#endif
+
+typedef uint32_t (*crc32c_fn)(uint32_t, const uint8_t *, size_t);
+
+// picked once, on the first call
+static crc32c_fn crc32c_pick()
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        return &crc32c_hw;
+    }
+#endif
+    crc32c_init_table();
+    return &crc32c_sw;
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    static const crc32c_fn fn = crc32c_pick();
+    return ~fn(~crc, (const uint8_t *)data, len);
+}
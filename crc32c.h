@@ -0,0 +1,7 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+// CRC-32C (Castagnoli), as used by iSCSI, ext4 and SSE4.2's crc32 instruction.
+// crc is the value returned for the preceding bytes, 0 to start.
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
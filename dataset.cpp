@@ -0,0 +1,269 @@
+#include "dataset.h"
+#include "crc32c.h"
+#include "hashtable.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool ds_write_all(int fd, const char *data, size_t size)
+{
+    size_t sent = 0;
+    while (sent < size)
+    {
+        ssize_t rv = write(fd, data + sent, size - sent);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv <= 0)
+        {
+            return false;
+        }
+        sent += (size_t)rv;
+    }
+    return true;
+}
+
+static void ds_flush(DsWriter *w)
+{
+    if (!w->failed && !ds_write_all(w->fd, w->buf.data(), w->buf.size()))
+    {
+        w->failed = true;
+    }
+    w->buf.clear();
+}
+
+bool ds_open(DsWriter *w, const char *tmp_path)
+{
+    w->fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0)
+    {
+        return false;
+    }
+    w->failed = false;
+    w->crc = 0;
+    w->hashes.clear();
+    w->offsets.clear();
+    w->buf.reserve(k_ds_buf + 4096);
+    // the header is written last, once the counts are known
+    w->buf.assign(k_ds_head, '\0');
+    w->pos = k_ds_head;
+    return true;
+}
+
+void ds_put(DsWriter *w, const char *key, size_t klen, const char *val, size_t vlen)
+{
+    w->hashes.push_back(str_hash((const uint8_t *)key, klen));
+    w->offsets.push_back(w->pos);
+    size_t from = w->buf.size();
+    uint32_t len[2] = {(uint32_t)klen, (uint32_t)vlen};
+    w->buf.append((const char *)len, 8);
+    w->buf.append(key, klen);
+    w->buf.append(val, vlen);
+    w->crc = crc32c(w->crc, w->buf.data() + from, w->buf.size() - from);
+    w->pos += w->buf.size() - from;
+    if (w->buf.size() >= k_ds_buf)
+    {
+        ds_flush(w);
+    }
+}
+
+// write the index and the header, fsync and atomically replace the old dataset
+bool ds_close(DsWriter *w, const char *tmp_path, const char *path)
+{
+    uint64_t nkeys = w->hashes.size();
+    uint64_t nslots = 2;
+    while (nslots < nkeys * 2)
+    {
+        nslots *= 2;
+    }
+    std::vector<uint64_t> slots(nslots * 2, 0);
+    for (uint64_t i = 0; i < nkeys; ++i)
+    {
+        uint64_t pos = w->hashes[i] & (nslots - 1);
+        while (slots[pos * 2 + 1])
+        {
+            pos = (pos + 1) & (nslots - 1);
+        }
+        slots[pos * 2] = w->hashes[i];
+        slots[pos * 2 + 1] = w->offsets[i];
+    }
+    ds_flush(w);
+    uint64_t index = w->pos;
+    const char *data = (const char *)slots.data();
+    size_t size = nslots * k_ds_slot;
+    uint32_t index_crc = crc32c(0, data, size);
+    if (!w->failed && !ds_write_all(w->fd, data, size))
+    {
+        w->failed = true;
+    }
+
+    char head[k_ds_head];
+    memcpy(head, k_ds_magic, 8);
+    memcpy(head + 8, &nkeys, 8);
+    memcpy(head + 16, &nslots, 8);
+    memcpy(head + 24, &index, 8);
+    memcpy(head + 32, &w->crc, 4);
+    memcpy(head + 36, &index_crc, 4);
+    bool ok = !w->failed && pwrite(w->fd, head, k_ds_head, 0) == (ssize_t)k_ds_head && fsync(w->fd) == 0;
+    ok = (close(w->fd) == 0) && ok;
+    w->fd = -1;
+    if (ok && rename(tmp_path, path) != 0)
+    {
+        ok = false;
+    }
+    if (!ok)
+    {
+        unlink(tmp_path);
+    }
+    return ok;
+}
+
+bool ds_map(DsFile *f, const char *path, bool *exists)
+{
+    int fd = open(path, O_RDONLY);
+    *exists = (fd >= 0 || errno != ENOENT);
+    if (fd < 0)
+    {
+        f->err = strerror(errno);
+        return !*exists;
+    }
+    struct stat st = {};
+    if (fstat(fd, &st) != 0)
+    {
+        f->err = strerror(errno);
+        close(fd);
+        return false;
+    }
+    f->size = (size_t)st.st_size;
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    void *data = f->size ? mmap(NULL, f->size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    int err = errno;
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        f->size = 0;
+        f->err = st.st_size ? strerror(err) : "empty file";
+        return false;
+    }
+    f->data = (const char *)data;
+    // lookups touch a slot and a record each, read-ahead would only evict pages
+    madvise(data, f->size, MADV_RANDOM);
+    if (f->size < k_ds_head || memcmp(f->data, k_ds_magic, sizeof(k_ds_magic)) != 0)
+    {
+        f->err = "not a dataset file";
+        ds_unmap(f);
+        return false;
+    }
+    memcpy(&f->nkeys, f->data + 8, 8);
+    memcpy(&f->nslots, f->data + 16, 8);
+    memcpy(&f->index, f->data + 24, 8);
+    if (f->nslots < 2 || (f->nslots & (f->nslots - 1)) || f->nkeys > f->nslots / 2 || f->index < k_ds_head ||
+        f->index > f->size || (f->size - f->index) / k_ds_slot != f->nslots || (f->size - f->index) % k_ds_slot)
+    {
+        f->err = "index size does not match the file";
+        ds_unmap(f);
+        return false;
+    }
+    return true;
+}
+
+void ds_unmap(DsFile *f)
+{
+    if (f->data)
+    {
+        munmap((void *)f->data, f->size);
+        f->data = NULL;
+        f->size = 0;
+    }
+}
+
+// the record at off, false if it does not fit between the header and the index
+static bool ds_record(const DsFile *f, uint64_t off, const char **key, uint32_t *klen, const char **val,
+                      uint32_t *vlen)
+{
+    if (off < k_ds_head || off > f->index || f->index - off < 8)
+    {
+        return false;
+    }
+    memcpy(klen, f->data + off, 4);
+    memcpy(vlen, f->data + off + 4, 4);
+    if (f->index - off - 8 < (uint64_t)*klen + *vlen)
+    {
+        return false;
+    }
+    *key = f->data + off + 8;
+    *val = *key + *klen;
+    return true;
+}
+
+bool ds_get(const DsFile *f, const char *key, size_t klen, const char **val, uint32_t *vlen)
+{
+    uint64_t hcode = str_hash((const uint8_t *)key, klen);
+    const char *slots = f->data + f->index;
+    // at most half full, an empty slot ends the probe long before the bound
+    uint64_t pos = hcode & (f->nslots - 1);
+    for (uint64_t n = 0; n < f->nslots; ++n, pos = (pos + 1) & (f->nslots - 1))
+    {
+        uint64_t slot[2];
+        memcpy(slot, slots + pos * k_ds_slot, k_ds_slot);
+        if (!slot[1])
+        {
+            return false;
+        }
+        const char *rkey = NULL;
+        uint32_t rklen = 0;
+        if (slot[0] == hcode && ds_record(f, slot[1], &rkey, &rklen, val, vlen) && rklen == klen &&
+            memcmp(rkey, key, klen) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ds_check(const DsFile *f, std::string &err)
+{
+    uint32_t crc[2];
+    memcpy(crc, f->data + 32, 8);
+    if (crc32c(0, f->data + k_ds_head, f->index - k_ds_head) != crc[0])
+    {
+        err = "records do not match their checksum";
+        return false;
+    }
+    if (crc32c(0, f->data + f->index, f->size - f->index) != crc[1])
+    {
+        err = "index does not match its checksum";
+        return false;
+    }
+    uint64_t used = 0;
+    bool empty_seen = false;
+    for (uint64_t pos = 0; pos < f->nslots; ++pos)
+    {
+        uint64_t slot[2];
+        memcpy(slot, f->data + f->index + pos * k_ds_slot, k_ds_slot);
+        if (!slot[1])
+        {
+            empty_seen = true;
+            continue;
+        }
+        used++;
+        const char *key = NULL, *val = NULL;
+        uint32_t klen = 0, vlen = 0;
+        if (!ds_record(f, slot[1], &key, &klen, &val, &vlen) || str_hash((const uint8_t *)key, klen) != slot[0])
+        {
+            err = "slot " + std::to_string(pos) + " does not point to its record";
+            return false;
+        }
+    }
+    if (used != f->nkeys || !empty_seen)
+    {
+        err = "the index does not add up to the header";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+// Immutable string dataset, built offline by snapshot_build --dataset and served
+// read-only by 11_server --dataset. GET is answered from the mapped file: the key
+// is hashed, the index probed and the value read from its record, so opening the
+// file decodes nothing. Integers are little-endian, as in the wire protocol.
+//
+//   header   "BRDSET01", u64 key count, u64 slot count (a power of two),
+//            u64 offset of the index, u32 CRC-32C of the records, u32 CRC-32C of the index
+//   records  per key: u32 key length, u32 value length, key, value
+//   index    per slot: u64 str_hash() of the key, u64 offset of its record or 0 if
+//            the slot is empty; linear probing, at most half of the slots are used
+//
+// The checksums are only checked by persist_check, opening the file stays O(1).
+
+const char k_ds_magic[8] = {'B', 'R', 'D', 'S', 'E', 'T', '0', '1'};
+const size_t k_ds_head = 8 + 8 + 8 + 8 + 4 + 4;
+const size_t k_ds_slot = 16;
+const size_t k_ds_buf = 1 << 16; // the writer flushes in blocks of this size
+
+struct DsWriter
+{
+    int fd = -1;
+    std::string buf;
+    bool failed = false;
+    uint64_t pos = 0; // file offset of the end of buf
+    uint32_t crc = 0; // of the records flushed so far
+    std::vector<uint64_t> hashes;
+    std::vector<uint64_t> offsets;
+};
+
+// the dataset is written to tmp_path and renamed over path once complete;
+// every key must be put once
+bool ds_open(DsWriter *w, const char *tmp_path);
+void ds_put(DsWriter *w, const char *key, size_t klen, const char *val, size_t vlen);
+bool ds_close(DsWriter *w, const char *tmp_path, const char *path);
+
+// A dataset mapped into memory. dev and ino tell a file renamed over it.
+struct DsFile
+{
+    const char *data = NULL;
+    size_t size = 0;
+    uint64_t nkeys = 0;
+    uint64_t nslots = 0;
+    uint64_t index = 0;
+    dev_t dev = 0;
+    ino_t ino = 0;
+    std::string err;
+};
+
+// returns false with f->err set; a missing file is not an error, *exists tells
+bool ds_map(DsFile *f, const char *path, bool *exists);
+void ds_unmap(DsFile *f);
+// the value points into the mapping; a record out of bounds reads as a miss
+bool ds_get(const DsFile *f, const char *key, size_t klen, const char **val, uint32_t *vlen);
+// checksums and every slot against its record, false with err set
+bool ds_check(const DsFile *f, std::string &err);
@@ -1,4 +1,5 @@
 #include "hashtable.h"
+#include <algorithm>
 
 const size_t k_resizing_work = 128;
 const size_t k_max_load_factor = 8;
@@ -60,7 +61,7 @@ HNode *hm_lookup(HMap *hmap, HNode *key, bool (*cmp)(HNode *, HNode *))
 
 void hm_help_resizing(HMap *hmap)
 {
-    if (hmap->ht2.tab == NULL)
+    if (hmap->ht2.tab == NULL || hmap->paused)
     {
         return;
     }
@@ -134,6 +135,45 @@ HNode *hm_pop(HMap *hmap, HNode *key, bool (*cmp)(HNode *, HNode *))
     return NULL;
 }
 
+size_t hm_size(const HMap *hmap)
+{
+    // Sum the sizes of the two hash tables
+    return hmap->ht1.size + hmap->ht2.size;
+}
+
+// make room for at least n nodes so that inserting them never triggers a resize.
+// any pending migration is finished eagerly, the caller is about to do O(n) work anyway.
+void hm_reserve(HMap *hmap, size_t n)
+{
+    size_t cap = 4;
+    while (cap * k_max_load_factor <= n)
+    {
+        cap *= 2;
+    }
+    if (hmap->ht1.tab && !hmap->ht2.tab && hmap->ht1.mask + 1 >= cap)
+    {
+        return;
+    }
+
+    HTab htab;
+    h_init(&htab, std::max(cap, hmap->ht1.mask + 1));
+    HTab *olds[2] = {&hmap->ht1, &hmap->ht2};
+    for (HTab *old : olds)
+    {
+        for (size_t i = 0; old->tab && i < old->mask + 1; ++i)
+        {
+            while (old->tab[i])
+            {
+                h_insert(&htab, h_detach(old, &old->tab[i]));
+            }
+        }
+        free(old->tab);
+        *old = HTab{};
+    }
+    hmap->ht1 = htab;
+    hmap->resizing_pos = 0;
+}
+
 uint64_t str_hash(const uint8_t *data, size_t size)
 {
     uint64_t hash = 5381; // Initial value, prime number
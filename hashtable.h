@@ -25,6 +25,7 @@ struct HMap
     HTab ht1;
     HTab ht2;
     size_t resizing_pos = 0;
+    bool paused = false; // no nodes are moved while set, e.g. during a fork
 };
 
 void h_init(HTab *htab, size_t n);
@@ -40,4 +41,6 @@ void hm_help_resizing(HMap *hmap);
 void hm_insert(HMap *hmap, HNode *node);
 void hm_start_resizing(HMap *hmap);
 HNode *hm_pop(HMap *hmap, HNode *key, bool (*cmp)(HNode *, HNode *));
+size_t hm_size(const HMap *hmap);
+void hm_reserve(HMap *hmap, size_t n);
 uint64_t str_hash(const uint8_t *data, size_t size);
@@ -0,0 +1,205 @@
+// Checks a snapshot or an append-only file written by 11_server, and repairs a damaged log.
+// A snapshot is checked chunk by chunk: its checksum, then every key is decoded.
+// A log is checked block by block: its checksum, then every request is framed.
+// A read-only dataset is checked against its checksums, then every slot of its index.
+// With --fix a log is truncated before the first bad block, which drops that block
+// and every later write. The server refuses to start on such a log, it only drops a
+// partial block at the very end by itself. A snapshot cannot be repaired: restore
+// it from the log or from an older copy.
+// usage: persist_check [--fix] file
+#include "crc32c.cpp"
+#include "snapshot.cpp"
+#include "aof.cpp"
+#include "hashtable.cpp"
+#include "dataset.cpp"
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+static bool read_file(const char *path, std::string &data) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return false;
+    }
+    char buf[1 << 16];
+    size_t n = 0;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        data.append(buf, n);
+    }
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+// decode every key of the chunk, false if it does not match the index
+static bool check_chunk(const SnapFile *f, size_t i, uint64_t *members) {
+    SnapCursor c = snap_chunk(f, i);
+    const char *key = nullptr, *data = nullptr;
+    uint32_t klen = 0, len = 0;
+    uint64_t keys = 0;
+    int type = 0;
+    while ((type = snap_next_key(&c, &key, &klen)) >= 0) {
+        keys++;
+        if (type == SNAP_DEL) {
+            continue;
+        }
+        if (type == SNAP_STR) {
+            snap_get_str(&c, &data, &len);
+            continue;
+        }
+        uint64_t n = 0;
+        snap_get_count(&c, &n);
+        double score = 0;
+        for (uint64_t j = 0; !c.failed && j < n; ++j) {
+            snap_get_member(&c, &score, &data, &len);
+            (*members)++;
+        }
+    }
+    return !c.failed && keys == f->chunks[i].nkeys;
+}
+
+static int check_snapshot(const char *path, bool fix) {
+    SnapFile f;
+    bool exists = false;
+    if (!snap_map(&f, path, &exists) || !exists) {
+        fprintf(stderr, "%s: %s\n", path, exists ? f.err.c_str() : "no such file");
+        return 1;
+    }
+    size_t bad = 0;
+    uint64_t members = 0;
+    for (size_t i = 0; i < f.chunks.size(); ++i) {
+        const char *err = nullptr;
+        if (!snap_check_chunk(&f, i)) {
+            err = "does not match its checksum";
+        } else if (!check_chunk(&f, i, &members)) {
+            err = "cannot be decoded";
+        }
+        if (err) {
+            printf("%s: chunk %zu at offset %llu (%llu keys) %s\n", path, i,
+                   (unsigned long long)f.chunks[i].offset, (unsigned long long)f.chunks[i].nkeys, err);
+            bad++;
+        }
+    }
+    printf("%s: %s of epoch %llu, %llu keys and %llu sorted set members in %zu chunks, %zu damaged\n", path,
+           f.base_epoch ? "delta checkpoint" : "snapshot", (unsigned long long)f.epoch, (unsigned long long)f.nkeys,
+           (unsigned long long)members, f.chunks.size(), bad);
+    if (f.base_epoch) {
+        printf("%s: applies to the snapshot of epoch %llu\n", path, (unsigned long long)f.base_epoch);
+    }
+    if (bad && fix) {
+        printf("%s: a snapshot cannot be repaired, restore it from the log or an older copy\n", path);
+    }
+    snap_unmap(&f);
+    return bad ? 1 : 0;
+}
+
+static int check_dataset(const char *path) {
+    DsFile f;
+    bool exists = false;
+    if (!ds_map(&f, path, &exists) || !exists) {
+        fprintf(stderr, "%s: %s\n", path, exists ? f.err.c_str() : "no such file");
+        return 1;
+    }
+    std::string err;
+    bool ok = ds_check(&f, err);
+    printf("%s: read-only dataset, %llu keys in %llu slots%s%s\n", path, (unsigned long long)f.nkeys,
+           (unsigned long long)f.nslots, ok ? "" : ", ", err.c_str());
+    ds_unmap(&f);
+    return ok ? 0 : 1;
+}
+
+// every request of a block: u32 length, u32 nargs, then u32 length and bytes per argument
+static bool frame_requests(const char *p, uint32_t size, uint64_t *count) {
+    for (uint32_t off = 0; off < size; (*count)++) {
+        uint32_t len = 0, nargs = 0;
+        memcpy(&len, p + off, 4);
+        const char *req = p + off + 4;
+        if (len < 4) {
+            return false;
+        }
+        memcpy(&nargs, req, 4);
+        uint32_t pos = 4;
+        for (uint32_t i = 0; i < nargs; ++i) {
+            uint32_t alen = 0;
+            if (len - pos < 4) {
+                return false;
+            }
+            memcpy(&alen, req + pos, 4);
+            if (len - pos - 4 < alen) {
+                return false;
+            }
+            pos += 4 + alen;
+        }
+        if (pos != len) {
+            return false;
+        }
+        off += 4 + len;
+    }
+    return true;
+}
+
+static int check_aof(const char *path, const std::string &data, bool fix) {
+    size_t pos = sizeof(k_aof_magic);
+    uint64_t blocks = 0, commands = 0;
+    const char *block = nullptr;
+    uint32_t size = 0;
+    int rv = 0;
+    while ((rv = aof_next_block(data.data(), data.size(), &pos, &block, &size)) == AOF_BLOCK_OK) {
+        if (!frame_requests(block, size, &commands)) {
+            pos = (size_t)(block - data.data()) - k_aof_block_head;
+            rv = AOF_BLOCK_BAD_REQUEST;
+            break;
+        }
+        blocks++;
+    }
+    printf("%s: append-only file, %llu commands in %llu good blocks\n", path, (unsigned long long)commands,
+           (unsigned long long)blocks);
+    if (rv == AOF_BLOCK_END) {
+        return 0;
+    }
+    printf("%s: %s at offset %zu, %zu bytes from there to the end\n", path, aof_block_error(rv), pos,
+           data.size() - pos);
+    if (!fix) {
+        printf("%s: run with --fix to truncate the log at offset %zu\n", path, pos);
+        return 1;
+    }
+    if (truncate(path, (off_t)pos) != 0) {
+        fprintf(stderr, "%s: cannot truncate: %s\n", path, strerror(errno));
+        return 1;
+    }
+    printf("%s: truncated to %zu bytes\n", path, pos);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    bool fix = argc == 3 && strcmp(argv[1], "--fix") == 0;
+    if (argc != 2 && !fix) {
+        fprintf(stderr, "usage: %s [--fix] file\n", argv[0]);
+        return 2;
+    }
+    const char *path = argv[argc - 1];
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    char magic[8] = {};
+    size_t n = fread(magic, 1, sizeof(magic), fp);
+    fclose(fp);
+    if (n == sizeof(k_snap_magic) && memcmp(magic, k_snap_magic, n) == 0) {
+        return check_snapshot(path, fix);
+    }
+    if (n == sizeof(k_ds_magic) && memcmp(magic, k_ds_magic, n) == 0) {
+        return check_dataset(path);
+    }
+    if (!aof_has_magic(magic, n)) {
+        fprintf(stderr, "%s: not a snapshot, an append-only file or a dataset\n", path);
+        return 1;
+    }
+    std::string data;
+    if (!read_file(path, data)) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    return check_aof(path, data, fix);
+}
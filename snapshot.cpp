@@ -0,0 +1,374 @@
+#include "snapshot.h"
+#include "crc32c.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// checksum whatever was appended to buf since the last call
+static void snap_crc_sync(SnapWriter *w)
+{
+    w->crc = crc32c(w->crc, w->buf.data() + w->crc_from, w->buf.size() - w->crc_from);
+    w->crc_from = w->buf.size();
+}
+
+static void snap_flush(SnapWriter *w)
+{
+    snap_crc_sync(w);
+    w->crc_from = 0;
+    size_t sent = 0;
+    while (!w->failed && sent < w->buf.size())
+    {
+        ssize_t rv = write(w->fd, w->buf.data() + sent, w->buf.size() - sent);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv <= 0)
+        {
+            w->failed = true;
+            break;
+        }
+        sent += (size_t)rv;
+    }
+    w->buf.clear();
+}
+
+static void snap_put(SnapWriter *w, const void *data, size_t size)
+{
+    w->buf.append((const char *)data, size);
+    w->pos += size;
+    if (w->buf.size() >= k_snap_buf)
+    {
+        snap_flush(w);
+    }
+}
+
+static void snap_put_u8(SnapWriter *w, uint8_t v)
+{
+    snap_put(w, &v, 1);
+}
+
+static void snap_put_u32(SnapWriter *w, uint32_t v)
+{
+    snap_put(w, &v, 4);
+}
+
+static void snap_put_u64(SnapWriter *w, uint64_t v)
+{
+    snap_put(w, &v, 8);
+}
+
+uint64_t snap_fresh_epoch()
+{
+    struct timespec ts = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec + 1;
+}
+
+bool snap_open(SnapWriter *w, const char *tmp_path, uint64_t nkeys, uint64_t epoch, uint64_t base_epoch)
+{
+    w->fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0)
+    {
+        return false;
+    }
+    w->failed = false;
+    w->pos = 0;
+    w->crc = 0;
+    w->crc_from = 0;
+    w->chunks.clear();
+    w->buf.reserve(k_snap_buf + 4096);
+    snap_put(w, k_snap_magic, sizeof(k_snap_magic));
+    snap_put_u64(w, nkeys);
+    snap_put_u64(w, epoch);
+    snap_put_u64(w, base_epoch);
+    w->head_crc = crc32c(0, w->buf.data(), w->buf.size());
+    return true;
+}
+
+// called before each key: start the first chunk, or a new one once the current one is full
+static void snap_put_key(SnapWriter *w, uint8_t type, const char *key, size_t klen)
+{
+    if (w->chunks.empty() || w->pos - w->chunks.back().offset >= k_snap_chunk)
+    {
+        snap_crc_sync(w);
+        if (!w->chunks.empty())
+        {
+            w->chunks.back().crc = w->crc;
+        }
+        w->crc = 0;
+        SnapChunk chunk;
+        chunk.offset = w->pos;
+        w->chunks.push_back(chunk);
+    }
+    w->chunks.back().nkeys++;
+    snap_put_u8(w, type);
+    snap_put_u32(w, (uint32_t)klen);
+    snap_put(w, key, klen);
+}
+
+void snap_put_str(SnapWriter *w, const char *key, size_t klen, const char *val, size_t vlen)
+{
+    snap_put_key(w, SNAP_STR, key, klen);
+    snap_put_u32(w, (uint32_t)vlen);
+    snap_put(w, val, vlen);
+}
+
+void snap_put_zset(SnapWriter *w, const char *key, size_t klen, uint64_t nmembers)
+{
+    snap_put_key(w, SNAP_ZSET, key, klen);
+    snap_put_u64(w, nmembers);
+}
+
+void snap_put_member(SnapWriter *w, double score, const char *name, size_t len)
+{
+    snap_put(w, &score, 8);
+    snap_put_u32(w, (uint32_t)len);
+    snap_put(w, name, len);
+}
+
+void snap_put_del(SnapWriter *w, const char *key, size_t klen)
+{
+    snap_put_key(w, SNAP_DEL, key, klen);
+}
+
+// write the index, flush, fsync and atomically replace the old snapshot
+bool snap_close(SnapWriter *w, const char *tmp_path, const char *path)
+{
+    uint64_t index = w->pos;
+    snap_crc_sync(w);
+    if (!w->chunks.empty())
+    {
+        w->chunks.back().crc = w->crc;
+    }
+    w->crc = w->head_crc;
+    for (size_t i = 0; i < w->chunks.size(); ++i)
+    {
+        uint64_t end = i + 1 < w->chunks.size() ? w->chunks[i + 1].offset : index;
+        w->chunks[i].size = end - w->chunks[i].offset;
+    }
+    snap_put_u64(w, w->chunks.size());
+    for (const SnapChunk &chunk : w->chunks)
+    {
+        snap_put_u64(w, chunk.offset);
+        snap_put_u64(w, chunk.size);
+        snap_put_u64(w, chunk.nkeys);
+        snap_put_u32(w, chunk.crc);
+    }
+    snap_crc_sync(w);
+    uint32_t index_crc = w->crc;
+    snap_put_u64(w, index);
+    snap_put_u32(w, index_crc);
+    snap_put(w, k_snap_index_magic, sizeof(k_snap_index_magic));
+    snap_flush(w);
+    bool ok = !w->failed && fsync(w->fd) == 0;
+    ok = (close(w->fd) == 0) && ok;
+    w->fd = -1;
+    if (ok && rename(tmp_path, path) != 0)
+    {
+        ok = false;
+    }
+    if (!ok)
+    {
+        unlink(tmp_path);
+    }
+    return ok;
+}
+
+static uint64_t snap_u64(const char *p)
+{
+    uint64_t v = 0;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+// the header, the trailer and the index must agree: the chunks cover
+// everything between the header and the index, in order
+static bool snap_parse_index(SnapFile *f)
+{
+    const size_t head = sizeof(k_snap_magic) + 8 + 8 + 8;
+    const size_t tail = 8 + 4 + sizeof(k_snap_index_magic);
+    const size_t entry = 8 + 8 + 8 + 4;
+    if (f->size < head + 8 + tail || memcmp(f->data, k_snap_magic, sizeof(k_snap_magic)) != 0)
+    {
+        f->err = "not a snapshot file";
+        return false;
+    }
+    if (memcmp(f->data + f->size - sizeof(k_snap_index_magic), k_snap_index_magic, sizeof(k_snap_index_magic)) != 0)
+    {
+        f->err = "no index at the end of the file, it is truncated";
+        return false;
+    }
+    f->nkeys = snap_u64(f->data + sizeof(k_snap_magic));
+    f->epoch = snap_u64(f->data + sizeof(k_snap_magic) + 8);
+    f->base_epoch = snap_u64(f->data + sizeof(k_snap_magic) + 16);
+    uint64_t index = snap_u64(f->data + f->size - tail);
+    if (index < head || index > f->size - tail - 8)
+    {
+        f->err = "index offset out of range";
+        return false;
+    }
+    uint64_t count = snap_u64(f->data + index);
+    if (count > (f->size - tail - index - 8) / entry || index + 8 + count * entry != f->size - tail)
+    {
+        f->err = "index size does not match the file";
+        return false;
+    }
+    uint32_t index_crc = 0;
+    memcpy(&index_crc, f->data + f->size - tail + 8, 4);
+    if (crc32c(crc32c(0, f->data, head), f->data + index, 8 + count * entry) != index_crc)
+    {
+        f->err = "header or index checksum mismatch";
+        return false;
+    }
+    uint64_t expect = head, nkeys = 0;
+    f->chunks.resize(count);
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        const char *p = f->data + index + 8 + i * entry;
+        SnapChunk &chunk = f->chunks[i];
+        chunk.offset = snap_u64(p);
+        chunk.size = snap_u64(p + 8);
+        chunk.nkeys = snap_u64(p + 16);
+        memcpy(&chunk.crc, p + 24, 4);
+        if (chunk.offset != expect || chunk.size > index - expect)
+        {
+            f->err = "chunk " + std::to_string(i) + " is out of place";
+            return false;
+        }
+        expect += chunk.size;
+        nkeys += chunk.nkeys;
+    }
+    if (expect != index || nkeys != f->nkeys)
+    {
+        f->err = "the chunks do not add up to the header";
+        return false;
+    }
+    return true;
+}
+
+bool snap_map(SnapFile *f, const char *path, bool *exists)
+{
+    int fd = open(path, O_RDONLY);
+    *exists = (fd >= 0 || errno != ENOENT);
+    if (fd < 0)
+    {
+        f->err = strerror(errno);
+        return !*exists;
+    }
+    struct stat st = {};
+    if (fstat(fd, &st) != 0)
+    {
+        f->err = strerror(errno);
+        close(fd);
+        return false;
+    }
+    f->size = (size_t)st.st_size;
+    void *data = f->size ? mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    int err = errno;
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        f->size = 0;
+        f->err = st.st_size ? strerror(err) : "empty file";
+        return false;
+    }
+    f->data = (const char *)data;
+    // every chunk is read front to back, by one of several threads
+    madvise(data, f->size, MADV_WILLNEED);
+    return snap_parse_index(f);
+}
+
+void snap_unmap(SnapFile *f)
+{
+    if (f->data)
+    {
+        munmap((void *)f->data, f->size);
+        f->data = NULL;
+        f->size = 0;
+    }
+}
+
+bool snap_check_chunk(const SnapFile *f, size_t i)
+{
+    const SnapChunk &chunk = f->chunks[i];
+    return crc32c(0, f->data + chunk.offset, chunk.size) == chunk.crc;
+}
+
+SnapCursor snap_chunk(const SnapFile *f, size_t i)
+{
+    SnapCursor c;
+    c.pos = f->data + f->chunks[i].offset;
+    c.end = c.pos + f->chunks[i].size;
+    return c;
+}
+
+static bool snap_take(SnapCursor *c, size_t size, const char **out)
+{
+    if (c->failed || (size_t)(c->end - c->pos) < size)
+    {
+        c->failed = true;
+        return false;
+    }
+    *out = c->pos;
+    c->pos += size;
+    return true;
+}
+
+static bool snap_take_str(SnapCursor *c, const char **str, uint32_t *len)
+{
+    const char *p = NULL;
+    if (!snap_take(c, 4, &p))
+    {
+        return false;
+    }
+    memcpy(len, p, 4);
+    return snap_take(c, *len, str);
+}
+
+int snap_next_key(SnapCursor *c, const char **key, uint32_t *klen)
+{
+    const char *p = NULL;
+    if (c->pos == c->end || !snap_take(c, 1, &p))
+    {
+        return -1;
+    }
+    uint8_t type = (uint8_t)*p;
+    if (type != SNAP_STR && type != SNAP_ZSET && type != SNAP_DEL)
+    {
+        c->failed = true;
+        return -1;
+    }
+    return snap_take_str(c, key, klen) ? type : -1;
+}
+
+bool snap_get_str(SnapCursor *c, const char **val, uint32_t *vlen)
+{
+    return snap_take_str(c, val, vlen);
+}
+
+bool snap_get_count(SnapCursor *c, uint64_t *n)
+{
+    const char *p = NULL;
+    if (!snap_take(c, 8, &p))
+    {
+        return false;
+    }
+    *n = snap_u64(p);
+    return true;
+}
+
+bool snap_get_member(SnapCursor *c, double *score, const char **name, uint32_t *len)
+{
+    const char *p = NULL;
+    if (!snap_take(c, 8, &p))
+    {
+        return false;
+    }
+    memcpy(score, p, 8);
+    return snap_take_str(c, name, len);
+}
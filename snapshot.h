@@ -0,0 +1,102 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// On-disk snapshot of the keyspace, written by SAVE/BGSAVE and loaded at startup.
+// A delta checkpoint has the same layout but only holds the keys written since
+// the previous checkpoint, deleted ones as SNAP_DEL. It names the full snapshot
+// (its base) it applies to by that snapshot's epoch. A keyspace that is not
+// loaded from a snapshot starts from snap_fresh_epoch(), so the files of an
+// unrelated run never name the same base.
+// Integers are little-endian, as in the wire protocol.
+//
+//   header   "BRSNAP04", u64 key count, u64 epoch, u64 epoch of the base (0 if full)
+//   chunks   keys, cut into chunks of about k_snap_chunk bytes; a key never
+//            spans two chunks, so every chunk can be decoded on its own
+//   per key  u8 type, u32 key length, key, then
+//              SNAP_STR   u32 value length, value
+//              SNAP_ZSET  u64 member count, then per member in (score, name)
+//                         order: f64 score, u32 name length, name
+//              SNAP_DEL   nothing, the key was deleted
+//   index    u64 chunk count, then per chunk: u64 offset, u64 size, u64 key count,
+//            u32 CRC-32C of the chunk
+//   trailer  u64 offset of the index, u32 CRC-32C of the header and the index, "BRSNAPIX"
+
+const char k_snap_magic[8] = {'B', 'R', 'S', 'N', 'A', 'P', '0', '4'};
+const char k_snap_index_magic[8] = {'B', 'R', 'S', 'N', 'A', 'P', 'I', 'X'};
+const size_t k_snap_buf = 1 << 16;   // the writer flushes in blocks of this size
+const size_t k_snap_chunk = 1 << 22; // a new chunk starts once this many bytes are written
+
+enum
+{
+    SNAP_STR = 0,
+    SNAP_ZSET = 1,
+    SNAP_DEL = 2,
+};
+
+struct SnapChunk
+{
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    uint64_t nkeys = 0;
+    uint32_t crc = 0;
+};
+
+struct SnapWriter
+{
+    int fd = -1;
+    std::string buf;
+    bool failed = false;
+    uint64_t pos = 0; // file offset of the end of buf
+    uint32_t crc = 0; // of the current chunk, up to buf[crc_from]
+    size_t crc_from = 0;
+    uint32_t head_crc = 0;
+    std::vector<SnapChunk> chunks;
+};
+
+// the first epoch of a keyspace that does not come from a snapshot:
+// the wall clock in nanoseconds, never 0
+uint64_t snap_fresh_epoch();
+// the snapshot is written to tmp_path and renamed over path once complete
+bool snap_open(SnapWriter *w, const char *tmp_path, uint64_t nkeys, uint64_t epoch, uint64_t base_epoch);
+void snap_put_str(SnapWriter *w, const char *key, size_t klen, const char *val, size_t vlen);
+void snap_put_zset(SnapWriter *w, const char *key, size_t klen, uint64_t nmembers);
+void snap_put_member(SnapWriter *w, double score, const char *name, size_t len);
+void snap_put_del(SnapWriter *w, const char *key, size_t klen);
+bool snap_close(SnapWriter *w, const char *tmp_path, const char *path);
+
+// A snapshot mapped into memory, with its index checked against the file
+struct SnapFile
+{
+    const char *data = NULL;
+    size_t size = 0;
+    uint64_t nkeys = 0;
+    uint64_t epoch = 0;
+    uint64_t base_epoch = 0;
+    std::vector<SnapChunk> chunks;
+    std::string err;
+};
+
+// returns false with f->err set; a missing file is not an error, *exists tells
+bool snap_map(SnapFile *f, const char *path, bool *exists);
+void snap_unmap(SnapFile *f);
+
+// Decodes the keys of one chunk in place; strings point into the mapping.
+// Any read past the end of the chunk sets failed and returns false.
+struct SnapCursor
+{
+    const char *pos = NULL;
+    const char *end = NULL;
+    bool failed = false;
+};
+
+// false if the chunk does not match its checksum
+bool snap_check_chunk(const SnapFile *f, size_t i);
+SnapCursor snap_chunk(const SnapFile *f, size_t i);
+// the next key and its type, -1 at the end of the chunk or on error
+int snap_next_key(SnapCursor *c, const char **key, uint32_t *klen);
+bool snap_get_str(SnapCursor *c, const char **val, uint32_t *vlen);
+bool snap_get_count(SnapCursor *c, uint64_t *n);
+bool snap_get_member(SnapCursor *c, double *score, const char **name, uint32_t *len);
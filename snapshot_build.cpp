@@ -0,0 +1,295 @@
+// Builds a snapshot for 11_server offline from CSV or TSV files, for bulk imports.
+// String rows are key,value and sorted set rows are key,score,member. A key seen
+// again takes the last value and a member seen again the last score, as with SET
+// and ZADD; a key used both as a string and as a sorted set is an error.
+// Members are written in (score, name) order so the server links every set without
+// sorting it, and the key count in the header sizes its keyspace up front: start
+// the server with --snapshot out. The snapshot gets a fresh epoch, so deltas left
+// next to out by an earlier server are not applied on top of it. The whole dataset
+// is held in memory, about as much as the server needs for it.
+// With --dataset the strings are written as a read-only dataset for
+// 11_server --dataset instead, with its hash index built here.
+// Files ending in .tsv are split on tabs, others are CSV with "quoted" fields
+// ("" is a quote inside one); --csv or --tsv overrides that. - reads stdin.
+// usage: snapshot_build [--csv|--tsv] [--dataset] [--strings file]... [--zsets file]... out
+#include "hashtable.cpp"
+#include "zset.cpp"
+#include "crc32c.cpp"
+#include "snapshot.cpp"
+#include "dataset.cpp"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+struct BKey {
+    HNode node;
+    std::string key;
+    std::string val;
+    bool str = false;
+    Zset *zset = nullptr;
+};
+
+struct Input {
+    const char *path = nullptr;
+    bool zsets = false;
+};
+
+static HMap g_keys;
+static uint64_t g_strings = 0, g_zsets = 0, g_members = 0;
+
+static bool bkey_eq(HNode *lhs, HNode *rhs) {
+    return container_of(lhs, BKey, node)->key == container_of(rhs, BKey, node)->key;
+}
+
+static BKey *key_get(const std::string &key) {
+    BKey probe;
+    probe.key = key;
+    probe.node.hcode = str_hash((const uint8_t *)key.data(), key.size());
+    HNode *node = hm_lookup(&g_keys, &probe.node, &bkey_eq);
+    if (node) {
+        return container_of(node, BKey, node);
+    }
+    BKey *bkey = new BKey();
+    bkey->key = key;
+    bkey->node.hcode = probe.node.hcode;
+    hm_insert(&g_keys, &bkey->node);
+    return bkey;
+}
+
+// Split one record into fields. False if a quoted field is still open at the end
+// of the line: the caller appends the next line and splits again.
+static bool split(const std::string &rec, char sep, bool csv, std::vector<std::string> &fields) {
+    fields.assign(1, std::string());
+    for (size_t i = 0; i < rec.size(); ++i) {
+        char ch = rec[i];
+        if (ch == sep) {
+            fields.emplace_back();
+        } else if (csv && ch == '"' && fields.back().empty()) {
+            for (i++;; i++) {
+                if (i == rec.size()) {
+                    return false;
+                }
+                if (rec[i] == '"' && (i + 1 == rec.size() || rec[i + 1] != '"')) {
+                    break;
+                }
+                i += rec[i] == '"'; // "" in a quoted field
+                fields.back().push_back(rec[i]);
+            }
+        } else {
+            fields.back().push_back(ch);
+        }
+    }
+    return true;
+}
+
+static bool parse_score(const std::string &s, double &out) {
+    char *endp = nullptr;
+    out = strtod(s.c_str(), &endp);
+    return !s.empty() && endp == s.c_str() + s.size() && !std::isnan(out);
+}
+
+static bool read_line(FILE *fp, char **buf, size_t *cap, std::string &line) {
+    ssize_t n = getline(buf, cap, fp);
+    if (n < 0) {
+        return false;
+    }
+    while (n > 0 && ((*buf)[n - 1] == '\n' || (*buf)[n - 1] == '\r')) {
+        n--;
+    }
+    line.assign(*buf, n);
+    return true;
+}
+
+static bool add_row(const Input &in, const std::vector<std::string> &f, std::string &err) {
+    size_t want = in.zsets ? 3 : 2;
+    if (f.size() != want) {
+        err = "expected " + std::to_string(want) + " fields, got " + std::to_string(f.size());
+        return false;
+    }
+    BKey *bkey = key_get(f[0]);
+    if (!in.zsets) {
+        if (bkey->zset) {
+            err = "key '" + f[0] + "' is already a sorted set";
+            return false;
+        }
+        bkey->str = true;
+        bkey->val = f[1];
+        return true;
+    }
+    double score = 0;
+    if (!parse_score(f[1], score)) {
+        err = "bad score '" + f[1] + "'";
+        return false;
+    }
+    if (bkey->str) {
+        err = "key '" + f[0] + "' is already a string";
+        return false;
+    }
+    if (!bkey->zset) {
+        bkey->zset = new Zset();
+    }
+    zset_bulk_add(bkey->zset, f[2].data(), f[2].size(), score);
+    return true;
+}
+
+static bool load_input(const Input &in, bool force_csv, bool force_tsv) {
+    bool stdin_in = strcmp(in.path, "-") == 0;
+    size_t plen = strlen(in.path);
+    bool tsv = force_tsv || (!force_csv && plen >= 4 && strcmp(in.path + plen - 4, ".tsv") == 0);
+    FILE *fp = stdin_in ? stdin : fopen(in.path, "rb");
+    if (!fp) {
+        fprintf(stderr, "%s: %s\n", in.path, strerror(errno));
+        return false;
+    }
+    char *buf = nullptr;
+    size_t cap = 0;
+    std::string rec, more, err;
+    std::vector<std::string> fields;
+    uint64_t lineno = 0, start = 0;
+    bool ok = true;
+    while (ok && read_line(fp, &buf, &cap, rec)) {
+        start = ++lineno;
+        bool whole = split(rec, tsv ? '\t' : ',', !tsv, fields);
+        while (!whole && read_line(fp, &buf, &cap, more)) {
+            lineno++;
+            rec += '\n';
+            rec += more;
+            whole = split(rec, ',', true, fields);
+        }
+        if (!whole) {
+            err = "quoted field is not closed";
+            ok = false;
+        } else if (!rec.empty()) {
+            ok = add_row(in, fields, err);
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "%s:%llu: %s\n", in.path, (unsigned long long)start, err.c_str());
+    } else if (ferror(fp)) {
+        fprintf(stderr, "%s: %s\n", in.path, strerror(errno));
+        ok = false;
+    }
+    free(buf);
+    if (!stdin_in) {
+        fclose(fp);
+    }
+    return ok;
+}
+
+static bool write_snapshot(const char *path) {
+    std::string tmp = std::string(path) + ".tmp";
+    SnapWriter w;
+    if (!snap_open(&w, tmp.c_str(), hm_size(&g_keys), snap_fresh_epoch(), 0)) {
+        fprintf(stderr, "%s: %s\n", tmp.c_str(), strerror(errno));
+        return false;
+    }
+    HTab *tabs[2] = {&g_keys.ht1, &g_keys.ht2};
+    for (HTab *htab : tabs) {
+        for (size_t i = 0; htab->tab && i < htab->mask + 1; ++i) {
+            for (HNode *node = htab->tab[i]; node; node = node->next) {
+                BKey *bkey = container_of(node, BKey, node);
+                if (!bkey->zset) {
+                    snap_put_str(&w, bkey->key.data(), bkey->key.size(), bkey->val.data(), bkey->val.size());
+                    g_strings++;
+                    continue;
+                }
+                Zset *zset = bkey->zset;
+                zset_bulk_build(zset);
+                uint64_t n = zset_size(zset);
+                snap_put_zset(&w, bkey->key.data(), bkey->key.size(), n);
+                for (Znode *z = zset_first(zset); z; z = znode_next(zset, z)) {
+                    ZMember member;
+                    znode_member(zset, z, &member);
+                    snap_put_member(&w, znode_score(zset, z), member.name, member.len);
+                }
+                zset_dispose(zset);
+                g_zsets++;
+                g_members += n;
+            }
+        }
+    }
+    if (!snap_close(&w, tmp.c_str(), path)) {
+        fprintf(stderr, "%s: cannot write the snapshot: %s\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static bool write_dataset(const char *path) {
+    std::string tmp = std::string(path) + ".tmp";
+    DsWriter w;
+    if (!ds_open(&w, tmp.c_str())) {
+        fprintf(stderr, "%s: %s\n", tmp.c_str(), strerror(errno));
+        return false;
+    }
+    HTab *tabs[2] = {&g_keys.ht1, &g_keys.ht2};
+    for (HTab *htab : tabs) {
+        for (size_t i = 0; htab->tab && i < htab->mask + 1; ++i) {
+            for (HNode *node = htab->tab[i]; node; node = node->next) {
+                BKey *bkey = container_of(node, BKey, node);
+                ds_put(&w, bkey->key.data(), bkey->key.size(), bkey->val.data(), bkey->val.size());
+                g_strings++;
+            }
+        }
+    }
+    if (!ds_close(&w, tmp.c_str(), path)) {
+        fprintf(stderr, "%s: cannot write the dataset: %s\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static int usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--csv|--tsv] [--dataset] [--strings file]... [--zsets file]... out\n", prog);
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    bool csv = false, tsv = false, dataset = false;
+    std::vector<Input> inputs;
+    const char *out = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--csv") == 0) {
+            csv = true;
+        } else if (strcmp(argv[i], "--tsv") == 0) {
+            tsv = true;
+        } else if (strcmp(argv[i], "--dataset") == 0) {
+            dataset = true;
+        } else if ((strcmp(argv[i], "--strings") == 0 || strcmp(argv[i], "--zsets") == 0) && i + 1 < argc) {
+            Input in;
+            in.zsets = strcmp(argv[i], "--zsets") == 0;
+            in.path = argv[++i];
+            inputs.push_back(in);
+        } else if (!out && argv[i][0] != '-') {
+            out = argv[i];
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    if (!out || inputs.empty() || (csv && tsv)) {
+        return usage(argv[0]);
+    }
+    for (const Input &in : inputs) {
+        if (dataset && in.zsets) {
+            fprintf(stderr, "%s: a dataset holds strings only\n", in.path);
+            return 2;
+        }
+    }
+    auto t0 = std::chrono::steady_clock::now();
+    for (const Input &in : inputs) {
+        if (!load_input(in, csv, tsv)) {
+            return 1;
+        }
+    }
+    if (!(dataset ? write_dataset(out) : write_snapshot(out))) {
+        return 1;
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    printf("%s: %llu strings, %llu sorted sets with %llu members in %.2fs\n", out, (unsigned long long)g_strings,
+           (unsigned long long)g_zsets, (unsigned long long)g_members, secs);
+    return 0;
+}
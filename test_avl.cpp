@@ -4,23 +4,24 @@
 #include <set>
 #include <cstdlib>
 #include <iostream>
+#include <vector>
 
 #define container_of(ptr, type, member) ({ \
     const typeof( ((type *)0)->member ) *__mptr = (ptr); \
     (type *)( (char *)__mptr - offsetof(type, member) ); })
 
 struct Data {
-    AVLNode node;
+    AVLSumNode node;
     uint32_t val = 0;
 };
 
 struct Container {
-    AVLNode* root = nullptr;
+    AVLSumNode* root = nullptr;
 };
 
 static void add(Container &c, uint32_t val) {
     Data *data = new Data();
-    avl_init(&data->node);
+    avl_init(&data->node, val);
     data->val = val;
 
     if (!c.root) {
@@ -28,9 +29,9 @@ static void add(Container &c, uint32_t val) {
         return;
     }
 
-    AVLNode *curr = c.root;
+    AVLSumNode *curr = c.root;
     while (true) {
-        AVLNode **from = (val < container_of(curr, Data, node)->val) ? &curr->left : &curr->right;
+        AVLSumNode **from = (val < container_of(curr, Data, node)->val) ? &curr->left : &curr->right;
 
         if (!*from) {
             *from = &data->node;
@@ -43,7 +44,7 @@ static void add(Container &c, uint32_t val) {
 }
 
 static bool del(Container &c, uint32_t val) {
-    AVLNode *curr = c.root;
+    AVLSumNode *curr = c.root;
     while (curr) {
         uint32_t node_val = container_of(curr, Data, node)->val;
         if (val == node_val) {
@@ -59,7 +60,16 @@ static bool del(Container &c, uint32_t val) {
     return true;
 }
 
-static void avl_verify(AVLNode *parent, AVLNode *node) {
+static uint32_t height(AVLSumNode *node) {
+    if (!node) {
+        return 0;
+    }
+    uint32_t l = height(node->left);
+    uint32_t r = height(node->right);
+    return 1 + (l < r ? r : l);
+}
+
+static void avl_verify(AVLSumNode *parent, AVLSumNode *node) {
     if (!node) return;
 
     assert(node->parent == parent);
@@ -68,12 +78,14 @@ static void avl_verify(AVLNode *parent, AVLNode *node) {
 
     assert(node->cnt == 1 + avl_cnt(node->left) + avl_cnt(node->right));
 
-    uint32_t l = avl_depth(node->left);
-    uint32_t r = avl_depth(node->right);
+    uint32_t l = height(node->left);
+    uint32_t r = height(node->right);
     assert(l == r || l+1 == r || l == r+1);
-    assert(node->depth == 1 + max(l, r));
+    assert(node->balance == (int)r - (int)l);
 
     uint32_t val = container_of(node, Data, node)->val;
+    assert(node->val == val);
+    assert(node->sum == node->val + avl_sum(node->left) + avl_sum(node->right));
     if (node->left) {
         assert(node->left->parent == node);
         assert(container_of(node->left, Data, node)->val <= val);
@@ -84,7 +96,7 @@ static void avl_verify(AVLNode *parent, AVLNode *node) {
     }
 }
 
-static void extract(AVLNode *node, std::multiset<uint32_t> &extracted) {
+static void extract(AVLSumNode *node, std::multiset<uint32_t> &extracted) {
     if (!node) {
         return;
     }
@@ -102,11 +114,23 @@ static void container_verify(Container &c, const std::multiset<uint32_t> &ref) {
     std::multiset<uint32_t> extracted;
     extract(c.root, extracted);
     assert(extracted == ref);
+
+    // range sums against a prefix sum of the reference
+    std::vector<double> prefix(1, 0);
+    for (uint32_t val : ref) {
+        prefix.push_back(prefix.back() + val);
+    }
+    int64_t n = (int64_t)ref.size();
+    for (int64_t lo = 0; lo < n; lo += 1 + n / 8) {
+        for (int64_t hi = lo; hi < n; hi += 1 + n / 8) {
+            assert(avl_sum_rank(c.root, lo, hi) == prefix[hi + 1] - prefix[lo]);
+        }
+    }
 }
 
 static void dispose(Container &c) {
     while (c.root) {
-        AVLNode *node = c.root;
+        AVLSumNode *node = c.root;
         c.root = avl_del(c.root);
         delete container_of(node, Data, node);
     }
@@ -147,6 +171,50 @@ static void test_remove(uint32_t sz) {
     }
 }
 
+static void test_build(uint32_t sz) {
+    std::vector<AVLSumNode *> nodes;
+    std::multiset<uint32_t> ref;
+    for (uint32_t i = 0; i < sz; ++i) {
+        Data *data = new Data();
+        avl_init(&data->node, i);
+        data->val = i;
+        nodes.push_back(&data->node);
+        ref.insert(i);
+    }
+    Container c;
+    c.root = avl_build(nodes.data(), nodes.size());
+    container_verify(c, ref);
+    // the tree must stay valid under further updates
+    add(c, sz / 2);
+    ref.insert(sz / 2);
+    container_verify(c, ref);
+    dispose(c);
+}
+
+// a long random mix, so the retracing stops at every possible height
+static void test_random_mix(uint32_t ops) {
+    Container c;
+    std::multiset<uint32_t> ref;
+    for (uint32_t i = 0; i < ops; ++i) {
+        uint32_t val = (uint32_t)rand() % 5000;
+        if (rand() % 3 == 0) {
+            auto it = ref.find(val);
+            assert(del(c, val) == (it != ref.end()));
+            if (it != ref.end()) {
+                ref.erase(it);
+            }
+        } else {
+            add(c, val);
+            ref.insert(val);
+        }
+        if (i % 1000 == 0) {
+            container_verify(c, ref);
+        }
+    }
+    container_verify(c, ref);
+    dispose(c);
+}
+
 int main() {
     // Basic tests
     Container c;
@@ -195,8 +263,11 @@ int main() {
     for (uint32_t i = 0; i < 200; ++i) {
         test_insert(i);
         test_remove(i);
+        test_build(i);
     }
 
+    test_random_mix(50000);
+
     std::cout << "All tests passed successfully!" << std::endl;
     return 0;
 }
\ No newline at end of file
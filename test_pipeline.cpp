@@ -0,0 +1,143 @@
+// Pipelining against a running 11_server on 127.0.0.1:3000, meant for
+// --aof path --appendfsync always, where replies are held until the log is synced.
+// A batch of SET/GET pairs larger than the server's read buffer is written at once,
+// then every reply must arrive, in order, before the receive timeout. A BZPOPMIN
+// queued behind held replies must not delay them.
+// usage: test_pipeline [pairs]   (default 1000)
+#include <arpa/inet.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+
+enum {
+    SER_NIL = 0,
+    SER_ERR = 1,
+    SER_STR = 2,
+};
+
+static void fail(const char *what, size_t i) {
+    fprintf(stderr, "FAIL: %s at reply %zu\n", what, i);
+    exit(1);
+}
+
+static void put_req(std::string &out, const std::vector<std::string> &cmd) {
+    uint32_t len = 4;
+    for (const std::string &s : cmd) {
+        len += 4 + (uint32_t)s.size();
+    }
+    uint32_t n = (uint32_t)cmd.size();
+    out.append((const char *)&len, 4);
+    out.append((const char *)&n, 4);
+    for (const std::string &s : cmd) {
+        uint32_t sz = (uint32_t)s.size();
+        out.append((const char *)&sz, 4);
+        out.append(s);
+    }
+}
+
+static bool read_full(int fd, char *buf, size_t n) {
+    while (n > 0) {
+        ssize_t rv = read(fd, buf, n);
+        if (rv <= 0) {
+            return false;  // error, EOF or the receive timeout
+        }
+        buf += rv;
+        n -= (size_t)rv;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const char *buf, size_t n) {
+    while (n > 0) {
+        ssize_t rv = write(fd, buf, n);
+        if (rv <= 0) {
+            return false;
+        }
+        buf += rv;
+        n -= (size_t)rv;
+    }
+    return true;
+}
+
+static std::string read_reply(int fd, size_t i) {
+    uint32_t len = 0;
+    if (!read_full(fd, (char *)&len, 4)) {
+        fail("no reply (stalled pipeline?)", i);
+    }
+    std::string res(len, '\0');
+    if (len == 0 || !read_full(fd, &res[0], len)) {
+        fail("short reply", i);
+    }
+    return res;
+}
+
+static int connect_server() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(3000);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("connect");
+        exit(1);
+    }
+    struct timeval tv = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    size_t pairs = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000;
+    int fd = connect_server();
+
+    std::string batch;
+    for (size_t i = 0; i < pairs; ++i) {
+        std::string key = "pipeline:" + std::to_string(i);
+        put_req(batch, {"set", key, "v" + std::to_string(i)});
+        put_req(batch, {"get", key});
+    }
+    if (!write_full(fd, batch.data(), batch.size())) {
+        perror("write");
+        return 1;
+    }
+    for (size_t i = 0; i < pairs; ++i) {
+        std::string res = read_reply(fd, 2 * i);
+        if (res[0] == SER_ERR) {
+            fail("SET error", 2 * i);
+        }
+        res = read_reply(fd, 2 * i + 1);
+        std::string want = "v" + std::to_string(i);
+        if (res.size() != 5 + want.size() || res[0] != SER_STR || res.compare(5, want.size(), want) != 0) {
+            fail("GET does not read the SET before it", 2 * i + 1);
+        }
+    }
+
+    // a write, a blocking pop that times out, then a read
+    batch.clear();
+    put_req(batch, {"set", "pipeline:block", "x"});
+    put_req(batch, {"bzpopmin", "pipeline:none", "0.2"});
+    put_req(batch, {"get", "pipeline:block"});
+    if (!write_full(fd, batch.data(), batch.size())) {
+        perror("write");
+        return 1;
+    }
+    if (read_reply(fd, 0)[0] == SER_ERR) {
+        fail("SET error", 0);
+    }
+    if (read_reply(fd, 1)[0] != SER_NIL) {
+        fail("BZPOPMIN did not time out", 1);
+    }
+    if (read_reply(fd, 2)[0] != SER_STR) {
+        fail("GET after BZPOPMIN", 2);
+    }
+    close(fd);
+    printf("%zu pipelined SET/GET pairs and a blocking pop answered in order\n", pairs);
+    return 0;
+}
@@ -1,162 +1,1572 @@
 #include "zset.h"
+#include <cmath>
 #include <cstring>
 #include <algorithm>
-Znode *znode_new(const char *name, size_t len, double score)
-{
-    Znode *node = (Znode *)malloc(sizeof(Znode) + len);
-    assert(node); // not the best thing in production but this is not prod
-    avl_init(&node->tree);
-    node->hmap.next = NULL;
-    node->hmap.hcode = str_hash((uint8_t *)name, len);
-    node->score = score;
-    node->len = len;
-    memcpy(&node->name[0], name, len);
+#include <vector>
+
+const size_t k_zmap_resizing_work = 128;
+const size_t k_zmap_max_load_factor = 8;
+
+// the node of a ref, NULL for 0
+static Znode *zn(const Zset *zset, ZRef ref)
+{
+    return ref ? (Znode *)(zset->arena.base + (size_t)ref * k_zarena_align) : NULL;
+}
+
+static ZRef zref(const Zset *zset, const Znode *node)
+{
+    return node ? (ZRef)(((const char *)node - zset->arena.base) / k_zarena_align) : 0;
+}
+
+// size class index of a node of this many bytes
+static size_t zarena_class(size_t size)
+{
+    return (size + k_zarena_align - 1) / k_zarena_align - 1;
+}
+
+static ZRef zarena_alloc(ZArena *arena, size_t size)
+{
+    size_t cls = zarena_class(size);
+    ZRef ref = arena->free_list[cls];
+    if (ref)
+    {
+        memcpy(&arena->free_list[cls], arena->base + (size_t)ref * k_zarena_align, sizeof(ZRef));
+        return ref;
+    }
+
+    size = (cls + 1) * k_zarena_align;
+    size_t used = std::max(arena->used, k_zarena_align); // ref 0 is none
+    if (used + size > arena->cap)
+    {
+        // refs are 32-bit, which bounds the buffer
+        size_t limit = (size_t)UINT32_MAX * k_zarena_align;
+        size_t cap = std::min(std::max(arena->cap + arena->cap / 2, k_zarena_min_cap), limit);
+        assert(used + size <= cap);
+        char *base = (char *)realloc(arena->base, cap);
+        assert(base);
+        arena->base = base;
+        arena->cap = cap;
+    }
+    arena->used = used + size;
+    return (ZRef)(used / k_zarena_align);
+}
+
+static void zarena_free(ZArena *arena, ZRef ref, size_t size)
+{
+    size_t cls = zarena_class(size);
+    memcpy(arena->base + (size_t)ref * k_zarena_align, &arena->free_list[cls], sizeof(ZRef));
+    arena->free_list[cls] = ref;
+}
+
+// release the buffer, nodes are not visited
+static void zarena_clear(ZArena *arena)
+{
+    free(arena->base);
+    *arena = ZArena{};
+}
+
+struct ZNameKey
+{
+    HNode node;
+    const char *name;
+    size_t len;
+};
+
+static bool zname_eq(HNode *node, HNode *key)
+{
+    ZName *zname = container_of(node, ZName, node);
+    ZNameKey *zkey = container_of(key, ZNameKey, node);
+    return zname->len == zkey->len && memcmp(zname->name, zkey->name, zkey->len) == 0;
+}
+
+static bool zname_same(HNode *node, HNode *key)
+{
+    return node == key;
+}
+
+static ZName *zname_of(const char *name)
+{
+    return (ZName *)(name - offsetof(ZName, name));
+}
+
+// the shared copy of a name, or NULL if no set holds it
+const char *zname_find(ZNamePool *pool, const char *name, size_t len, uint64_t hcode)
+{
+    ZNameKey key;
+    key.node.hcode = hcode;
+    key.name = name;
+    key.len = len;
+    HNode *found = hm_lookup(&pool->map, &key.node, &zname_eq);
+    return found ? container_of(found, ZName, node)->name : NULL;
+}
+
+// take a reference to the shared copy of a name, adding it if needed
+const char *zname_acquire(ZNamePool *pool, const char *name, size_t len, uint64_t hcode)
+{
+    const char *shared = zname_find(pool, name, len, hcode);
+    if (shared)
+    {
+        zname_of(shared)->refs++;
+        return shared;
+    }
+    ZName *zname = (ZName *)malloc(sizeof(ZName) + len);
+    assert(zname);
+    zname->node.next = NULL;
+    zname->node.hcode = hcode;
+    zname->refs = 1;
+    zname->len = (uint32_t)len;
+    memcpy(&zname->name[0], name, len);
+    hm_insert(&pool->map, &zname->node);
+    return zname->name;
+}
+
+void zname_release(ZNamePool *pool, const char *name)
+{
+    ZName *zname = zname_of(name);
+    if (--zname->refs == 0)
+    {
+        HNode *found = hm_pop(&pool->map, &zname->node, &zname_same);
+        assert(found == &zname->node);
+        (void)found;
+        free(zname);
+    }
+}
+
+static const char *znode_name(const Znode *node)
+{
+    if (node->len & k_zname_ptr)
+    {
+        const char *name;
+        memcpy(&name, node->buf, sizeof(name));
+        return name;
+    }
+    return node->buf;
+}
+
+static uint32_t znode_len(const Znode *node)
+{
+    return node->len & ~k_zname_ptr;
+}
+
+static int64_t znode_int(const Znode *node)
+{
+    int64_t v;
+    memcpy(&v, &node->len, sizeof(v));
+    return v;
+}
+
+static const uint64_t k_pow10[20] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull,
+    100000000ull, 1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull,
+    10000000000000ull, 100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+    100000000000000000ull, 1000000000000000000ull, 10000000000000000000ull,
+};
+
+// decimal digits of v
+static int zint_digits(uint64_t v)
+{
+    if (v < 10)
+    {
+        return 1;
+    }
+    int t = ((64 - __builtin_clzll(v)) * 1233) >> 12; // about log10(2) * bits
+    return t + (v >= k_pow10[t]);
+}
+
+// an integer member: the canonical decimal form of an int64, -?[1-9][0-9]*|0
+static bool zint_parse(const char *name, size_t len, int64_t *out)
+{
+    if (len == 0 || len > k_zint_max_len)
+    {
+        return false;
+    }
+    bool neg = (name[0] == '-');
+    size_t i = neg ? 1 : 0;
+    if (i == len || len - i > 19 || (name[i] == '0' && len > i + 1))
+    {
+        return false;
+    }
+    uint64_t v = 0; // at most 19 digits, no overflow
+    for (; i < len; ++i)
+    {
+        if (name[i] < '0' || name[i] > '9')
+        {
+            return false;
+        }
+        v = v * 10 + (uint64_t)(name[i] - '0');
+    }
+    if (neg ? (v == 0 || v > (uint64_t)INT64_MAX + 1) : v > (uint64_t)INT64_MAX)
+    {
+        return false;
+    }
+    *out = neg ? (int64_t)(0 - v) : (int64_t)v;
+    return true;
+}
+
+static uint32_t zint_format(int64_t v, char *buf)
+{
+    char tmp[k_zint_max_len];
+    uint64_t u = v < 0 ? 0 - (uint64_t)v : (uint64_t)v;
+    size_t n = 0;
+    do
+    {
+        tmp[n++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    uint32_t len = 0;
+    if (v < 0)
+    {
+        buf[len++] = '-';
+    }
+    while (n)
+    {
+        buf[len++] = tmp[--n];
+    }
+    return len;
+}
+
+// Integer members are ordered like their decimal forms: negatives first,
+// then by the digits, which compare like the values scaled to 19 digits,
+// a prefix before the longer form.
+static int zint_cmp(int64_t a, int64_t b)
+{
+    if (a == b)
+    {
+        return 0;
+    }
+    if ((a < 0) != (b < 0))
+    {
+        return a < 0 ? -1 : 1;
+    }
+    uint64_t x = a < 0 ? 0 - (uint64_t)a : (uint64_t)a;
+    uint64_t y = b < 0 ? 0 - (uint64_t)b : (uint64_t)b;
+    int dx = zint_digits(x);
+    int dy = zint_digits(y);
+    if (dx == dy)
+    {
+        return x < y ? -1 : 1;
+    }
+    x *= k_pow10[19 - dx];
+    y *= k_pow10[19 - dy];
+    if (x != y)
+    {
+        return x < y ? -1 : 1;
+    }
+    return dx < dy ? -1 : 1;
+}
+
+// a score stored as an integer: integral, in range, and not -0
+static bool zscore_int(double score, int64_t *out)
+{
+    if (!(score >= -9223372036854775808.0 && score < 9223372036854775808.0))
+    {
+        return false;
+    }
+    int64_t v = (int64_t)score;
+    if ((double)v != score || (v == 0 && std::signbit(score)))
+    {
+        return false;
+    }
+    *out = v;
+    return true;
+}
+
+void znode_member(const Zset *zset, const Znode *node, ZMember *member)
+{
+    if (zset->ints & ZSET_INT_NAMES)
+    {
+        member->len = zint_format(znode_int(node), member->buf);
+        member->name = member->buf;
+    }
+    else
+    {
+        member->name = znode_name(node);
+        member->len = znode_len(node);
+    }
+}
+
+double znode_score(const Zset *zset, const Znode *node)
+{
+    return (zset->ints & ZSET_INT_SCORES) ? (double)node->iscore : node->dscore;
+}
+
+// the score must fit the representation of the set
+static void znode_set_score(const Zset *zset, Znode *node, double score)
+{
+    if (zset->ints & ZSET_INT_SCORES)
+    {
+        node->iscore = (int64_t)score;
+    }
+    else
+    {
+        node->dscore = score;
+    }
+}
+
+// bytes of a node: with an integer member, a pointer to the name, or the name
+static size_t znode_size(const Zset *zset, const Znode *node)
+{
+    if (zset->ints & ZSET_INT_NAMES)
+    {
+        return offsetof(Znode, len) + sizeof(int64_t);
+    }
+    return offsetof(Znode, buf) + ((node->len & k_zname_ptr) ? sizeof(const char *) : node->len);
+}
+
+// a single node tree
+static void znode_init(const Zset *zset, Znode *node)
+{
+    node->left = node->right = node->parent = 0;
+    node->cnt = (1u << k_zbal_bits) | 2;
+    node->sum = znode_score(zset, node);
+}
+
+// the (score, name) must fit the representation of the set, and the name
+// must not point into the set itself: the nodes may move
+static ZRef znode_new(Zset *zset, const char *name, size_t len, double score, uint64_t hcode)
+{
+    int64_t v = 0;
+    bool int_name = (zset->ints & ZSET_INT_NAMES) && zint_parse(name, len, &v);
+    bool out = !int_name && (zset->pool || offsetof(Znode, buf) + len > k_zarena_max_node);
+    size_t size = int_name ? offsetof(Znode, len) + sizeof(v)
+                           : offsetof(Znode, buf) + (out ? sizeof(const char *) : len);
+    ZRef ref = zarena_alloc(&zset->arena, size);
+    Znode *node = zn(zset, ref);
+    node->next = 0;
+    node->hcode = (uint32_t)hcode;
+    znode_set_score(zset, node, score);
+    znode_init(zset, node);
+    if (int_name)
+    {
+        memcpy(&node->len, &v, sizeof(v));
+        return ref;
+    }
+    node->len = (uint32_t)len;
+    if (out)
+    {
+        const char *ptr = NULL;
+        if (zset->pool)
+        {
+            ptr = zname_acquire(zset->pool, name, len, hcode);
+        }
+        else
+        {
+            char *copy = (char *)malloc(len);
+            assert(copy);
+            memcpy(copy, name, len);
+            ptr = copy;
+            zset->arena.large++;
+        }
+        memcpy(node->buf, &ptr, sizeof(ptr));
+        node->len |= k_zname_ptr;
+    }
+    else
+    {
+        memcpy(node->buf, name, len);
+    }
+    return ref;
+}
+
+// drop the name if it is not stored in the node
+static void znode_release(Zset *zset, Znode *node)
+{
+    if ((zset->ints & ZSET_INT_NAMES) || !(node->len & k_zname_ptr))
+    {
+        return;
+    }
+    if (zset->pool)
+    {
+        zname_release(zset->pool, znode_name(node));
+    }
+    else
+    {
+        free((void *)znode_name(node));
+        zset->arena.large--;
+    }
+}
+
+static void znode_del(Zset *zset, Znode *node)
+{
+    znode_release(zset, node);
+    zarena_free(&zset->arena, zref(zset, node), znode_size(zset, node));
+}
+
+// The tree: an AVL tree like AVL.cpp, over refs.
+
+static uint32_t zcnt(const Zset *zset, ZRef ref)
+{
+    return ref ? zn(zset, ref)->cnt >> k_zbal_bits : 0;
+}
+
+static double zsum(const Zset *zset, ZRef ref)
+{
+    return ref ? zn(zset, ref)->sum : 0;
+}
+
+static int zbal(const Znode *node)
+{
+    return (int)(node->cnt & k_zbal_mask) - 2;
+}
+
+static void zbal_set(Znode *node, int balance)
+{
+    node->cnt = (node->cnt & ~k_zbal_mask) | (uint32_t)(balance + 2);
+}
+
+// maintain cnt and sum, the balance is maintained by the callers
+static void ztree_update(const Zset *zset, Znode *node)
+{
+    uint32_t cnt = 1 + zcnt(zset, node->left) + zcnt(zset, node->right);
+    node->cnt = (cnt << k_zbal_bits) | (node->cnt & k_zbal_mask);
+    node->sum = znode_score(zset, node) + zsum(zset, node->left) + zsum(zset, node->right);
+}
+
+// recompute cnt and sum from node up to the root, the shape is unchanged
+static void ztree_refresh(const Zset *zset, Znode *node)
+{
+    for (; node; node = zn(zset, node->parent))
+    {
+        ztree_update(zset, node);
+    }
+}
+
+// LL rotation, returns the new subtree root
+static Znode *ztree_rotate_left(Zset *zset, Znode *node)
+{
+    ZRef ref = zref(zset, node);
+    ZRef new_ref = node->right;
+    Znode *new_node = zn(zset, new_ref);
+    if (new_node->left)
+    {
+        zn(zset, new_node->left)->parent = ref;
+    }
+    node->right = new_node->left;
+    new_node->left = ref;
+    new_node->parent = node->parent;
+    node->parent = new_ref;
+    // the heights below the two nodes are unchanged, derive the new balances
+    int new_bal = zbal(new_node);
+    int bal = zbal(node) - 1 - (new_bal > 0 ? new_bal : 0);
+    zbal_set(node, bal);
+    zbal_set(new_node, new_bal - 1 + (bal < 0 ? bal : 0));
+    ztree_update(zset, node);
+    ztree_update(zset, new_node);
+    return new_node;
+}
+
+// RR rotation
+static Znode *ztree_rotate_right(Zset *zset, Znode *node)
+{
+    ZRef ref = zref(zset, node);
+    ZRef new_ref = node->left;
+    Znode *new_node = zn(zset, new_ref);
+    if (new_node->right)
+    {
+        zn(zset, new_node->right)->parent = ref;
+    }
+    node->left = new_node->right;
+    new_node->right = ref;
+    new_node->parent = node->parent;
+    node->parent = new_ref;
+    int new_bal = zbal(new_node);
+    int bal = zbal(node) + 1 - (new_bal < 0 ? new_bal : 0);
+    zbal_set(node, bal);
+    zbal_set(new_node, new_bal + 1 + (bal > 0 ? bal : 0));
+    ztree_update(zset, node);
+    ztree_update(zset, new_node);
+    return new_node;
+}
+
+// rebalance a node whose balance reached +-2, returns the new subtree root
+static Znode *ztree_rebalance(Zset *zset, Znode *node)
+{
+    if (zbal(node) < 0)
+    {
+        Znode *left = zn(zset, node->left);
+        if (zbal(left) > 0)
+        {
+            node->left = zref(zset, ztree_rotate_left(zset, left));
+        }
+        return ztree_rotate_right(zset, node);
+    }
+    Znode *right = zn(zset, node->right);
+    if (zbal(right) < 0)
+    {
+        node->right = zref(zset, ztree_rotate_right(zset, right));
+    }
+    return ztree_rotate_left(zset, node);
+}
+
+// retrace after linking a new leaf, returns the new root.
+// the balances are only adjusted until the subtree height stops changing,
+// above that point the walk just maintains cnt and sum.
+static ZRef ztree_fix(Zset *zset, Znode *node)
+{
+    bool grew = true;
+    while (node->parent)
+    {
+        Znode *parent = zn(zset, node->parent);
+        Znode *up = zn(zset, parent->parent);
+        ZRef *from = NULL;
+        if (up)
+        {
+            from = (up->left == node->parent) ? &up->left : &up->right;
+        }
+
+        if (grew)
+        {
+            int bal = zbal(parent) + (parent->left == zref(zset, node) ? -1 : 1);
+            zbal_set(parent, bal);
+            if (bal == 0)
+            {
+                grew = false;
+            }
+            else if (bal == 2 || bal == -2)
+            {
+                // an insertion rotation restores the previous height
+                parent = ztree_rebalance(zset, parent);
+                grew = false;
+            }
+        }
+        ztree_update(zset, parent);
+
+        if (from)
+        {
+            *from = zref(zset, parent);
+        }
+        node = parent;
+    }
+    return zref(zset, node);
+}
+
+// detach a node, returns the new root
+static ZRef ztree_del(Zset *zset, Znode *node)
+{
+    ZRef ref = zref(zset, node);
+    Znode *parent = NULL;   // where the retracing starts
+    bool from_left = false; // the side of parent that lost a level
+
+    if (node->left && node->right)
+    {
+        // the successor takes the place of the node
+        ZRef victim_ref = node->right;
+        Znode *victim = zn(zset, victim_ref);
+        while (victim->left)
+        {
+            victim_ref = victim->left;
+            victim = zn(zset, victim_ref);
+        }
+        if (victim->parent == ref)
+        {
+            parent = victim;
+            from_left = false;
+        }
+        else
+        {
+            parent = zn(zset, victim->parent);
+            from_left = true;
+            parent->left = victim->right;
+            if (victim->right)
+            {
+                zn(zset, victim->right)->parent = victim->parent;
+            }
+            victim->right = node->right;
+            zn(zset, victim->right)->parent = victim_ref;
+        }
+        victim->left = node->left;
+        zn(zset, victim->left)->parent = victim_ref;
+        zbal_set(victim, zbal(node));
+        victim->parent = node->parent;
+        if (node->parent)
+        {
+            Znode *up = zn(zset, node->parent);
+            (up->left == ref ? up->left : up->right) = victim_ref;
+        }
+    }
+    else
+    {
+        // at most one child, link it to the parent
+        ZRef child = node->left ? node->left : node->right;
+        parent = zn(zset, node->parent);
+        if (child)
+        {
+            zn(zset, child)->parent = node->parent;
+        }
+        if (!parent)
+        {
+            // removing root
+            return child;
+        }
+        from_left = (parent->left == ref);
+        (from_left ? parent->left : parent->right) = child;
+    }
+
+    bool shrunk = true;
+    while (true)
+    {
+        Znode *up = zn(zset, parent->parent);
+        ZRef *from = NULL;
+        bool up_left = false;
+        if (up)
+        {
+            up_left = (up->left == zref(zset, parent));
+            from = up_left ? &up->left : &up->right;
+        }
+
+        if (shrunk)
+        {
+            int bal = zbal(parent) + (from_left ? 1 : -1);
+            zbal_set(parent, bal);
+            if (bal == 1 || bal == -1)
+            {
+                // was even, the height is unchanged
+                shrunk = false;
+            }
+            else if (bal == 2 || bal == -2)
+            {
+                // with an even sibling the rotation keeps the height
+                Znode *sibling = zn(zset, bal > 0 ? parent->right : parent->left);
+                shrunk = (zbal(sibling) != 0);
+                parent = ztree_rebalance(zset, parent);
+            }
+        }
+        ztree_update(zset, parent);
+
+        if (!from)
+        {
+            return zref(zset, parent);
+        }
+        *from = zref(zset, parent);
+        from_left = up_left;
+        parent = up;
+    }
+}
+
+// in-order successor, walks at most one root-to-leaf path
+static Znode *ztree_next(const Zset *zset, Znode *node)
+{
+    if (node->right)
+    {
+        node = zn(zset, node->right);
+        while (node->left)
+        {
+            node = zn(zset, node->left);
+        }
+        return node;
+    }
+    ZRef ref = zref(zset, node);
+    Znode *parent = zn(zset, node->parent);
+    while (parent && parent->right == ref)
+    {
+        ref = node->parent;
+        node = parent;
+        parent = zn(zset, node->parent);
+    }
+    return parent;
+}
+
+// in-order predecessor
+static Znode *ztree_prev(const Zset *zset, Znode *node)
+{
+    if (node->left)
+    {
+        node = zn(zset, node->left);
+        while (node->right)
+        {
+            node = zn(zset, node->right);
+        }
+        return node;
+    }
+    ZRef ref = zref(zset, node);
+    Znode *parent = zn(zset, node->parent);
+    while (parent && parent->left == ref)
+    {
+        ref = node->parent;
+        node = parent;
+        parent = zn(zset, node->parent);
+    }
+    return parent;
+}
+
+// offset into the succeeding or preceding node.
+// note: the worst-case is O(log(n)) regardless of how long the offset is.
+static Znode *ztree_offset(const Zset *zset, Znode *node, int64_t offset)
+{
+    int64_t pos = 0; // relative to the starting node
+    while (offset != pos)
+    {
+        if (pos < offset && pos + zcnt(zset, node->right) >= offset)
+        {
+            // the target is inside the right subtree
+            node = zn(zset, node->right);
+            pos += zcnt(zset, node->left) + 1;
+        }
+        else if (pos > offset && pos - zcnt(zset, node->left) <= offset)
+        {
+            // the target is inside the left subtree
+            node = zn(zset, node->left);
+            pos -= zcnt(zset, node->right) + 1;
+        }
+        else
+        {
+            // go to the parent
+            Znode *parent = zn(zset, node->parent);
+            if (!parent)
+            {
+                return NULL;
+            }
+            if (parent->right == zref(zset, node))
+            {
+                pos -= zcnt(zset, node->left) + 1;
+            }
+            else
+            {
+                pos += zcnt(zset, node->right) + 1;
+            }
+            node = parent;
+        }
+    }
     return node;
 }
 
-void tree_add(Zset *zset, Znode *node)
+// height of a tree of n nodes built by ztree_build(): the bit width of n
+static int ztree_build_height(size_t n)
+{
+    int h = 0;
+    for (; n; n >>= 1)
+    {
+        h++;
+    }
+    return h;
+}
+
+// build a perfectly balanced tree from nodes already in sorted order.
+// the recursion depth is O(log(n)), every node is visited once.
+static ZRef ztree_build(Zset *zset, const ZRef *nodes, size_t n, ZRef parent)
+{
+    if (n == 0)
+    {
+        return 0;
+    }
+    size_t mid = n / 2;
+    ZRef ref = nodes[mid];
+    Znode *node = zn(zset, ref);
+    node->parent = parent;
+    node->left = ztree_build(zset, nodes, mid, ref);
+    node->right = ztree_build(zset, nodes + mid + 1, n - mid - 1, ref);
+    zbal_set(node, ztree_build_height(n - mid - 1) - ztree_build_height(mid));
+    ztree_update(zset, node);
+    return ref;
+}
+
+// sum of the scores ranked [lo, hi] in this subtree.
+// only the two boundary paths are descended, so this is O(log(n)).
+static double ztree_sum_rank(const Zset *zset, ZRef ref, int64_t lo, int64_t hi)
+{
+    int64_t cnt = zcnt(zset, ref);
+    if (!ref || hi < 0 || lo >= cnt || lo > hi)
+    {
+        return 0;
+    }
+    Znode *node = zn(zset, ref);
+    if (lo <= 0 && hi >= cnt - 1)
+    {
+        return node->sum;
+    }
+    int64_t l = zcnt(zset, node->left);
+    double rv = ztree_sum_rank(zset, node->left, lo, hi);
+    if (lo <= l && l <= hi)
+    {
+        rv += znode_score(zset, node);
+    }
+    return rv + ztree_sum_rank(zset, node->right, lo - l - 1, hi - l - 1);
+}
+
+// Names are compared 8 bytes at a time as byte-swapped little-endian words,
+// which orders them like memcmp without a library call for the common short
+// prefix. Other byte orders use memcmp for the whole name.
+static int zname_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+    size_t n = std::min(alen, blen);
+    size_t i = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; i + 8 <= n; i += 8)
+    {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (x != y)
+        {
+            return __builtin_bswap64(x) < __builtin_bswap64(y) ? -1 : 1;
+        }
+    }
+#endif
+    int rv = memcmp(a + i, b + i, n - i);
+    if (rv != 0)
+    {
+        return rv;
+    }
+    return alen < blen ? -1 : (alen > blen ? 1 : 0);
+}
+
+// Comparisons are generated for each representation of the set: S is the
+// type of the scores, N that of the member names.
+template <class S>
+static S zscore(const Znode *node);
+
+template <>
+double zscore<double>(const Znode *node)
+{
+    return node->dscore;
+}
+
+template <>
+int64_t zscore<int64_t>(const Znode *node)
+{
+    return node->iscore;
+}
+
+// member names stored as bytes
+struct ZStrNames
+{
+    struct Key
+    {
+        const char *name;
+        size_t len;
+    };
+
+    static Key key(const Znode *node)
+    {
+        return Key{znode_name(node), znode_len(node)};
+    }
+
+    static Key key(const char *name, size_t len)
+    {
+        return Key{name, len};
+    }
+
+    static int cmp(const Znode *node, const Key &key)
+    {
+        return zname_cmp(znode_name(node), znode_len(node), key.name, key.len);
+    }
+};
+
+// integer members, the name must be one
+struct ZIntNames
+{
+    typedef int64_t Key;
+
+    static Key key(const Znode *node)
+    {
+        return znode_int(node);
+    }
+
+    static Key key(const char *name, size_t len)
+    {
+        int64_t v = 0;
+        zint_parse(name, len, &v);
+        return v;
+    }
+
+    static int cmp(const Znode *node, Key key)
+    {
+        return zint_cmp(znode_int(node), key);
+    }
+};
+
+// compare by the (score, name) tuple
+template <class S, class N>
+static bool zless(const Znode *lhs, S score, const typename N::Key &key)
+{
+    S s = zscore<S>(lhs);
+    if (s != score)
+    {
+        return s < score;
+    }
+    return N::cmp(lhs, key) < 0;
+}
+
+template <class S, class N>
+static bool zless(const Znode *lhs, const Znode *rhs)
+{
+    return zless<S, N>(lhs, zscore<S>(rhs), N::key(rhs));
+}
+
+// call f(S(), N()) with the types of the set
+template <class F>
+static void zset_as(const Zset *zset, F f)
+{
+    switch (zset->ints)
+    {
+    case ZSET_INT_SCORES | ZSET_INT_NAMES:
+        f(int64_t(), ZIntNames());
+        break;
+    case ZSET_INT_SCORES:
+        f(int64_t(), ZStrNames());
+        break;
+    case ZSET_INT_NAMES:
+        f(double(), ZIntNames());
+        break;
+    default:
+        f(double(), ZStrNames());
+        break;
+    }
+}
+
+// compare with any (score, name), whatever the representation of the set
+static bool zless_any(const Zset *zset, const Znode *lhs, double score, const char *name, size_t len)
+{
+    double s = znode_score(zset, lhs);
+    if (s != score)
+    {
+        return s < score;
+    }
+    ZMember member;
+    znode_member(zset, lhs, &member);
+    return zname_cmp(member.name, member.len, name, len) < 0;
+}
+
+// link a single node tree in, by (score, name)
+template <class S, class N>
+static void ztree_add(Zset *zset, Znode *node)
 {
-    if (!zset->tree)
+    ZRef ref = zref(zset, node);
+    if (!zset->root)
     {
-        zset->tree = &node->tree;
+        zset->root = ref;
         return;
     }
 
-    AVLNode *curr = zset->tree;
+    Znode *curr = zn(zset, zset->root);
     while (true)
     {
-        AVLNode **from = zless(&node->tree, curr) ? &curr->left : &curr->right;
+        ZRef *from = zless<S, N>(node, curr) ? &curr->left : &curr->right;
+        if (!*from)
+        {
+            *from = ref;
+            node->parent = zref(zset, curr);
+            zset->root = ztree_fix(zset, node);
+            return;
+        }
+        curr = zn(zset, *from);
+    }
+}
 
-        if (!from)
+// The member table.
+
+static void ztab_init(ZTab *tab, size_t n)
+{
+    assert(n > 0 && ((n - 1) & n) == 0);
+    tab->tab = (ZRef *)calloc(n, sizeof(ZRef));
+    assert(tab->tab);
+    tab->mask = (uint32_t)(n - 1);
+    tab->size = 0;
+}
+
+static void ztab_insert(Zset *zset, ZTab *tab, Znode *node)
+{
+    ZRef *slot = &tab->tab[node->hcode & tab->mask];
+    node->next = *slot;
+    *slot = zref(zset, node);
+    tab->size++;
+}
+
+// the link to the member with this name, or this integer name, NULL if absent.
+// interned names are matched by pointer.
+static ZRef *ztab_find(Zset *zset, ZTab *tab, const char *name, size_t len, int64_t v, uint32_t hcode)
+{
+    if (!tab->tab)
+    {
+        return NULL;
+    }
+    bool ints = zset->ints & ZSET_INT_NAMES;
+    for (ZRef *from = &tab->tab[hcode & tab->mask]; *from; from = &zn(zset, *from)->next)
+    {
+        Znode *node = zn(zset, *from);
+        if (node->hcode != hcode)
         {
-            *from = &node->tree;
-            node->tree.parent = curr;
-            zset->tree = avl_fix(&node->tree);
-            break;
+            continue;
+        }
+        if (ints ? znode_int(node) == v
+                 : znode_len(node) == len &&
+                       (zset->pool ? znode_name(node) == name : memcmp(znode_name(node), name, len) == 0))
+        {
+            return from;
         }
-        curr = *from;
     }
+    return NULL;
 }
 
-// compare by the (score, name) tuple
-bool zless(AVLNode *lhs, double score, const char *name, size_t len)
+// move some members from the old table to the new one
+static void zmap_help_resizing(Zset *zset)
 {
-    Znode *zl = container_of(lhs, Znode, tree);
-    if (zl->score != score)
+    ZMap *map = &zset->map;
+    if (!map->ht2.tab)
+    {
+        return;
+    }
+
+    size_t work_done = 0;
+    while (work_done < k_zmap_resizing_work && map->ht2.size > 0)
     {
-        return zl->score < score;
+        ZRef *from = &map->ht2.tab[map->resizing_pos];
+        if (!*from)
+        {
+            map->resizing_pos++;
+            continue;
+        }
+        Znode *node = zn(zset, *from);
+        *from = node->next;
+        map->ht2.size--;
+        ztab_insert(zset, &map->ht1, node);
+        work_done++;
     }
-    int rv = memcmp(zl->name, name, std::min(zl->len, len));
-    if (rv != 0)
+
+    if (map->ht2.size == 0)
+    {
+        free(map->ht2.tab);
+        map->ht2 = ZTab{};
+    }
+}
+
+static void zmap_insert(Zset *zset, Znode *node)
+{
+    ZMap *map = &zset->map;
+    if (!map->ht1.tab)
+    {
+        ztab_init(&map->ht1, 4);
+    }
+    ztab_insert(zset, &map->ht1, node);
+
+    if (!map->ht2.tab && map->ht1.size / ((size_t)map->ht1.mask + 1) >= k_zmap_max_load_factor)
+    {
+        // create a bigger table and move the members over progressively
+        map->ht2 = map->ht1;
+        ztab_init(&map->ht1, ((size_t)map->ht1.mask + 1) * 2);
+        map->resizing_pos = 0;
+    }
+    zmap_help_resizing(zset);
+}
+
+static Znode *zmap_find(Zset *zset, const char *name, size_t len, uint64_t hcode)
+{
+    zmap_help_resizing(zset);
+    // the hash is that of the name in both cases
+    int64_t v = 0;
+    if (zset->ints & ZSET_INT_NAMES)
+    {
+        if (!zint_parse(name, len, &v))
+        {
+            return NULL;
+        }
+    }
+    else if (zset->pool)
+    {
+        // interned names are matched by pointer, and a name the pool
+        // does not hold cannot be in the set
+        name = zname_find(zset->pool, name, len, hcode);
+        if (!name)
+        {
+            return NULL;
+        }
+    }
+    ZRef *from = ztab_find(zset, &zset->map.ht1, name, len, v, (uint32_t)hcode);
+    if (!from)
+    {
+        from = ztab_find(zset, &zset->map.ht2, name, len, v, (uint32_t)hcode);
+    }
+    return from ? zn(zset, *from) : NULL;
+}
+
+static void zmap_remove(Zset *zset, Znode *node)
+{
+    zmap_help_resizing(zset);
+    ZRef ref = zref(zset, node);
+    ZTab *tabs[2] = {&zset->map.ht1, &zset->map.ht2};
+    for (ZTab *tab : tabs)
+    {
+        for (ZRef *from = tab->tab ? &tab->tab[node->hcode & tab->mask] : NULL; from && *from;
+             from = &zn(zset, *from)->next)
+        {
+            if (*from == ref)
+            {
+                *from = node->next;
+                tab->size--;
+                return;
+            }
+        }
+    }
+    assert(!"the member is not in the table");
+}
+
+size_t zset_size(const Zset *zset)
+{
+    return (size_t)zset->map.ht1.size + zset->map.ht2.size;
+}
+
+// a score that is not integral: store every score as a double from now on
+static void zset_fit_score(Zset *zset, double score)
+{
+    int64_t v;
+    if (!(zset->ints & ZSET_INT_SCORES) || zscore_int(score, &v))
+    {
+        return;
+    }
+    ZTab *tabs[2] = {&zset->map.ht1, &zset->map.ht2};
+    for (ZTab *tab : tabs)
+    {
+        for (size_t i = 0; tab->tab && i < (size_t)tab->mask + 1; ++i)
+        {
+            for (ZRef ref = tab->tab[i]; ref; ref = zn(zset, ref)->next)
+            {
+                Znode *node = zn(zset, ref);
+                node->dscore = (double)node->iscore;
+            }
+        }
+    }
+    zset->ints &= ~ZSET_INT_SCORES;
+}
+
+// A member that is not an integer: store every name as bytes from now on.
+// The nodes change size, so they are copied to a new buffer and linked in
+// the same order, integer members are ordered like their decimal forms.
+// The refs of a load in progress are replaced.
+static void zset_fit_name(Zset *zset, const char *name, size_t len, ZLoad *load)
+{
+    int64_t v;
+    if (!(zset->ints & ZSET_INT_NAMES) || zint_parse(name, len, &v))
+    {
+        return;
+    }
+    Zset old = *zset;
+    zset->root = 0;
+    zset->map = ZMap{};
+    zset->arena = ZArena{};
+    zset->ints &= ~ZSET_INT_NAMES;
+    zset_reserve(zset, zset_size(&old));
+
+    std::vector<ZRef> nodes; // in the order of the tree or of the load
+    auto copy = [&](Znode *node)
+    {
+        ZMember member;
+        znode_member(&old, node, &member);
+        uint64_t hcode = str_hash((uint8_t *)member.name, member.len);
+        ZRef ref = znode_new(zset, member.name, member.len, znode_score(&old, node), hcode);
+        zmap_insert(zset, zn(zset, ref));
+        nodes.push_back(ref);
+    };
+    ZTab *tabs[2] = {&old.map.ht1, &old.map.ht2};
+    if (old.root)
+    {
+        for (Znode *node = zset_first(&old); node; node = ztree_next(&old, node))
+        {
+            copy(node);
+        }
+        zset->root = ztree_build(zset, nodes.data(), nodes.size(), 0);
+    }
+    else if (load && load->sorted)
+    {
+        for (ZRef ref : load->nodes)
+        {
+            copy(zn(&old, ref));
+        }
+        load->nodes.swap(nodes);
+    }
+    else
+    {
+        for (ZTab *tab : tabs)
+        {
+            for (size_t i = 0; tab->tab && i < (size_t)tab->mask + 1; ++i)
+            {
+                for (ZRef ref = tab->tab[i]; ref; ref = zn(&old, ref)->next)
+                {
+                    copy(zn(&old, ref));
+                }
+            }
+        }
+    }
+    for (ZTab *tab : tabs)
     {
-        return rv < 0;
+        free(tab->tab);
     }
-    return zl->len < len;
+    zarena_clear(&old.arena);
 }
 
-bool zless(AVLNode *lhs, AVLNode *rhs)
+// move a node to its new score, the score fits the set
+template <class S, class N>
+static void zset_move(Zset *zset, Znode *node, double score)
 {
-    Znode *zr = container_of(rhs, Znode, tree);
-    return zless(lhs, zr->score, zr->name, zr->len);
+    // the neighbours still bracket the new score: the order is unchanged,
+    // so skip the delete and the re-insert together with their rebalancing.
+    Znode *prev = ztree_prev(zset, node);
+    Znode *next = ztree_next(zset, node);
+    typename N::Key key = N::key(node);
+    if ((!prev || zless<S, N>(prev, (S)score, key)) && (!next || !zless<S, N>(next, (S)score, key)))
+    {
+        znode_set_score(zset, node, score);
+        ztree_refresh(zset, node);
+        return;
+    }
+    zset->root = ztree_del(zset, node);
+    znode_set_score(zset, node, score);
+    znode_init(zset, node);
+    ztree_add<S, N>(zset, node);
 }
 
 // update the score of an existing node (AVL tree reinsertion)
 
 void zset_update(Zset *zset, Znode *node, double score)
 {
-    if (node->score == score)
+    if (znode_score(zset, node) == score)
     {
         return;
     }
-    zset->tree = avl_del(&node->tree);
-    node->score = score;
-    avl_init(&node->tree);
-    tree_add(zset, node);
+    zset->version++;
+    zset_fit_score(zset, score);
+    zset_as(zset, [&](auto s, auto n)
+            { zset_move<decltype(s), decltype(n)>(zset, node, score); });
 }
 
 // add a new (score, name) tuple, or update the score of an exisiting tuple
 bool zset_add(Zset *zset, const char *name, size_t len, double score)
 {
-    Znode *node = zset_lookup(zset, name, len);
+    zset_fit_name(zset, name, len, NULL);
+    uint64_t hcode = str_hash((uint8_t *)name, len);
+    Znode *node = zmap_find(zset, name, len, hcode);
     if (node)
     {
         zset_update(zset, node, score);
         return false;
     }
-    else
+    assert(zset_size(zset) < k_zset_max);
+    zset_fit_score(zset, score);
+    node = zn(zset, znode_new(zset, name, len, score, hcode));
+    zmap_insert(zset, node);
+    zset_as(zset, [&](auto s, auto n)
+            { ztree_add<decltype(s), decltype(n)>(zset, node); });
+    zset->version++;
+    return true;
+}
+
+// detach a member from both indexes and free it
+void zset_delete(Zset *zset, Znode *node)
+{
+    zmap_remove(zset, node);
+    zset->root = ztree_del(zset, node);
+    znode_del(zset, node);
+    zset->version++;
+}
+
+// Lookup by name, the node is valid until the next insertion
+Znode *zset_lookup(Zset *zset, const char *name, size_t len)
+{
+    if (!zset->map.ht1.tab && !zset->map.ht2.tab)
     {
-        node = znode_new(name, len, score);
-        hm_insert(&zset->hmap, &node->hmap);
-        tree_add(zset, node);
-        return true;
+        return NULL;
     }
+    return zmap_find(zset, name, len, str_hash((uint8_t *)name, len));
 }
 
-// Comparison function for hash lookup
-bool znode_cmp(HNode *node, HNode *key)
+Znode *zset_query(Zset *zset, double score, const char *name, size_t len, int64_t offset)
 {
-    Znode *znode = container_of(node, Znode, hmap);
-    Znode *zkey = container_of(key, Znode, hmap);
-    if (znode->len != zkey->len)
+    Znode *found = NULL;
+    Znode *curr = zn(zset, zset->root);
+
+    while (curr)
     {
-        return false;
+        if (zless_any(zset, curr, score, name, len))
+        {
+            curr = zn(zset, curr->right);
+        }
+        else
+        {
+            found = curr; // candidate
+            curr = zn(zset, curr->left);
+        }
     }
-    return memcmp(znode->name, zkey->name, zkey->len) == 0;
+
+    return found ? ztree_offset(zset, found, offset) : NULL;
 }
 
-// Lookup by name
-Znode *zset_lookup(Zset *zset, const char *name, size_t len)
+// presize the member table for n members.
+// any pending migration is finished eagerly, the caller is about to do O(n) work anyway.
+void zset_reserve(Zset *zset, size_t n)
 {
-    if (!zset->hmap.ht1.tab && !zset->hmap.ht2.tab)
+    ZMap *map = &zset->map;
+    size_t cap = 4;
+    while (cap * k_zmap_max_load_factor <= n)
+    {
+        cap *= 2;
+    }
+    if (map->ht1.tab && !map->ht2.tab && (size_t)map->ht1.mask + 1 >= cap)
     {
-        return nullptr;
+        return;
+    }
+
+    ZTab tab;
+    ztab_init(&tab, std::max(cap, (size_t)map->ht1.mask + 1));
+    ZTab *olds[2] = {&map->ht1, &map->ht2};
+    for (ZTab *old : olds)
+    {
+        for (size_t i = 0; old->tab && i < (size_t)old->mask + 1; ++i)
+        {
+            while (old->tab[i])
+            {
+                Znode *node = zn(zset, old->tab[i]);
+                old->tab[i] = node->next;
+                ztab_insert(zset, &tab, node);
+            }
+        }
+        free(old->tab);
+        *old = ZTab{};
     }
+    map->ht1 = tab;
+    map->resizing_pos = 0;
+}
 
-    // Create a temporary hash node as a key for lookup
-    HNode key;
-    key.hcode = str_hash((uint8_t *)name, len);
+// bulk loading, step 1: add or update a member in the member table only.
+// the tree is left empty until zset_bulk_build() is called.
+bool zset_bulk_add(Zset *zset, const char *name, size_t len, double score)
+{
+    assert(!zset->root);
+    zset->version++;
+    zset_fit_name(zset, name, len, NULL);
+    zset_fit_score(zset, score);
+    uint64_t hcode = str_hash((uint8_t *)name, len);
+    Znode *node = zmap_find(zset, name, len, hcode);
+    if (node)
+    {
+        znode_set_score(zset, node, score);
+        return false;
+    }
+    assert(zset_size(zset) < k_zset_max);
+    zmap_insert(zset, zn(zset, znode_new(zset, name, len, score, hcode)));
+    return true;
+}
 
-    // We need a temporary znode to store the name for comparison
-    // This is allocated on stack just for comparison purposes
-    char buf[sizeof(Znode) + len];
-    Znode *tmp = (Znode *)buf;
-    tmp->len = len;
-    tmp->hmap.hcode = key.hcode;
-    memcpy(&tmp->name[0], name, len);
+// bulk loading, step 2: sort every member once and build the tree bottom-up
+void zset_bulk_build(Zset *zset)
+{
+    assert(!zset->root);
+    std::vector<ZRef> nodes;
+    nodes.reserve(zset_size(zset));
+    ZTab *tabs[2] = {&zset->map.ht1, &zset->map.ht2};
+    for (ZTab *tab : tabs)
+    {
+        for (size_t i = 0; tab->tab && i < (size_t)tab->mask + 1; ++i)
+        {
+            for (ZRef ref = tab->tab[i]; ref; ref = zn(zset, ref)->next)
+            {
+                nodes.push_back(ref);
+            }
+        }
+    }
+    zset_as(zset, [&](auto s, auto n)
+            {
+                typedef decltype(s) S;
+                typedef decltype(n) N;
+                std::sort(nodes.begin(), nodes.end(), [zset](ZRef lhs, ZRef rhs)
+                          { return zless<S, N>(zn(zset, lhs), zn(zset, rhs)); });
+            });
+    zset->root = ztree_build(zset, nodes.data(), nodes.size(), 0);
+    zset->version++;
+}
 
-    // Lookup the node in the hash map
-    HNode *found = hm_lookup(&zset->hmap, &tmp->hmap, &znode_cmp);
+// like zset_bulk_add(), but also remember the arrival order while it is sorted
+void zset_load_add(Zset *zset, ZLoad *load, const char *name, size_t len, double score)
+{
+    assert(!zset->root);
+    zset->version++;
+    zset_fit_name(zset, name, len, load);
+    zset_fit_score(zset, score);
+    uint64_t hcode = str_hash((uint8_t *)name, len);
+    Znode *node = zmap_find(zset, name, len, hcode);
+    if (node)
+    {
+        znode_set_score(zset, node, score);
+        load->sorted = false;
+        load->nodes = std::vector<ZRef>();
+        return;
+    }
+    bool in_order = true;
+    if (load->sorted && !load->nodes.empty())
+    {
+        zset_as(zset, [&](auto s, auto n)
+                {
+                    typedef decltype(s) S;
+                    typedef decltype(n) N;
+                    in_order = zless<S, N>(zn(zset, load->nodes.back()), (S)score, N::key(name, len));
+                });
+    }
+    if (!in_order)
+    {
+        load->sorted = false;
+        load->nodes = std::vector<ZRef>();
+    }
+    assert(zset_size(zset) < k_zset_max);
+    ZRef ref = znode_new(zset, name, len, score, hcode);
+    zmap_insert(zset, zn(zset, ref));
+    if (load->sorted)
+    {
+        load->nodes.push_back(ref);
+    }
+}
 
-    if (!found)
+void zset_load_build(Zset *zset, ZLoad *load)
+{
+    if (!load->sorted)
     {
-        return nullptr;
+        zset_bulk_build(zset);
+        return;
     }
+    zset->root = ztree_build(zset, load->nodes.data(), load->nodes.size(), 0);
+    zset->version++;
+    load->nodes = std::vector<ZRef>();
+}
 
-    return container_of(found, Znode, hmap);
+// the member at a 0-based rank, descending from the root by subtree sizes
+Znode *zset_at(Zset *zset, int64_t rank)
+{
+    Znode *curr = zn(zset, zset->root);
+    while (curr)
+    {
+        int64_t l = zcnt(zset, curr->left);
+        if (rank < l)
+        {
+            curr = zn(zset, curr->left);
+        }
+        else if (rank > l)
+        {
+            rank -= l + 1;
+            curr = zn(zset, curr->right);
+        }
+        else
+        {
+            return curr;
+        }
+    }
+    return NULL;
 }
 
-Znode *zset_query(Zset *zset, double score, const char *name, size_t len, int64_t offset)
+// number of members preceding this one
+int64_t zset_rank(Zset *zset, Znode *node)
 {
-    AVLNode *found = NULL;
-    AVLNode *curr = zset->tree;
+    int64_t rank = zcnt(zset, node->left);
+    ZRef ref = zref(zset, node);
+    for (Znode *parent = zn(zset, node->parent); parent; parent = zn(zset, parent->parent))
+    {
+        if (parent->right == ref)
+        {
+            rank += zcnt(zset, parent->left) + 1;
+        }
+        ref = zref(zset, parent);
+    }
+    return rank;
+}
 
+// the first member whose score is above the given one (or equal, if inclusive)
+Znode *zset_seek_score(Zset *zset, double score, bool inclusive)
+{
+    Znode *found = NULL;
+    Znode *curr = zn(zset, zset->root);
     while (curr)
     {
-        if (zless(curr, score, name, len))
+        double s = znode_score(zset, curr);
+        if (s > score || (inclusive && s == score))
         {
-            curr = curr->right;
+            found = curr;
+            curr = zn(zset, curr->left);
         }
         else
         {
-            found = curr; // candidate
-            curr = curr->left;
+            curr = zn(zset, curr->right);
         }
     }
+    return found;
+}
+
+// sum of the scores ranked [lo, hi], O(log(n))
+double zset_sum_rank(Zset *zset, int64_t lo, int64_t hi)
+{
+    return ztree_sum_rank(zset, zset->root, lo, hi);
+}
+
+// the lowest member
+Znode *zset_first(Zset *zset)
+{
+    Znode *curr = zn(zset, zset->root);
+    while (curr && curr->left)
+    {
+        curr = zn(zset, curr->left);
+    }
+    return curr;
+}
+
+// the highest member
+Znode *zset_last(Zset *zset)
+{
+    Znode *curr = zn(zset, zset->root);
+    while (curr && curr->right)
+    {
+        curr = zn(zset, curr->right);
+    }
+    return curr;
+}
+
+Znode *znode_next(Zset *zset, Znode *node)
+{
+    return ztree_next(zset, node);
+}
+
+Znode *znode_prev(Zset *zset, Znode *node)
+{
+    return ztree_prev(zset, node);
+}
+
+// position an iterator at a rank counted from the lowest member,
+// or from the highest one when reversed
+ZIter zset_iter(Zset *zset, int64_t rank, bool reverse)
+{
+    ZIter iter;
+    iter.zset = zset;
+    iter.reverse = reverse;
+    int64_t size = zcnt(zset, zset->root);
+    if (rank >= 0 && rank < size)
+    {
+        iter.node = zset_at(zset, reverse ? size - 1 - rank : rank);
+    }
+    return iter;
+}
 
-    if (found)
+// return the current member and step to the next one, NULL at the end.
+// the iterator is invalidated by any change to the set.
+Znode *ziter_next(ZIter *iter)
+{
+    Znode *node = iter->node;
+    if (node)
     {
-        found = avl_offset(found, offset);
+        iter->node = iter->reverse ? ztree_prev(iter->zset, node) : ztree_next(iter->zset, node);
     }
+    return node;
+}
 
-    return found ? container_of(found, Znode, tree) : NULL;
-}
\ No newline at end of file
+// free every member and the member table, leaving an empty set.
+// only nodes whose names are interned or too long are visited one by one.
+void zset_dispose(Zset *zset)
+{
+    bool visit = !(zset->ints & ZSET_INT_NAMES) && (zset->arena.large || zset->pool);
+    ZTab *tabs[2] = {&zset->map.ht1, &zset->map.ht2};
+    for (ZTab *tab : tabs)
+    {
+        for (size_t i = 0; visit && tab->tab && i < (size_t)tab->mask + 1; ++i)
+        {
+            for (ZRef ref = tab->tab[i]; ref; ref = zn(zset, ref)->next)
+            {
+                znode_release(zset, zn(zset, ref));
+            }
+        }
+        free(tab->tab);
+    }
+    zarena_clear(&zset->arena);
+    *zset = Zset{};
+}
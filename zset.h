@@ -1,35 +1,187 @@
 #pragma once
-#include "AVL.cpp"
 #include "hashtable.h"
+#include <vector>
+
+// Nodes of a set live in one buffer and link to each other with 32-bit refs:
+// the offset into the buffer in k_zarena_align units, 0 for none.
+typedef uint32_t ZRef;
+
+const size_t k_zarena_align = 8;       // node sizes are rounded up to this
+const size_t k_zarena_max_node = 256;  // longer names are stored out of the node
+const size_t k_zarena_min_cap = 256;   // bytes of the first buffer
+
+// per-zset node buffer: nodes are carved sequentially and freed nodes are
+// reused by size class. The buffer grows with realloc(), so refs stay valid
+// across an insertion but pointers to nodes do not.
+struct ZArena
+{
+    char *base = NULL;
+    size_t used = 0; // bytes carved, the first unit is never handed out (ref 0)
+    size_t cap = 0;
+    ZRef free_list[k_zarena_max_node / k_zarena_align] = {};
+    size_t large = 0; // names that did not fit their node
+};
+
+// a member name shared by every zset using the same pool
+struct ZName
+{
+    HNode node;
+    uint32_t refs = 0;
+    uint32_t len = 0;
+    char name[0];
+};
+
+// refcounted, immutable member names, keyed by str_hash()
+struct ZNamePool
+{
+    HMap map;
+};
+
+// the member table: chains of refs through Znode::next, resized
+// progressively like HMap
+struct ZTab
+{
+    ZRef *tab = NULL;
+    uint32_t mask = 0;
+    uint32_t size = 0;
+};
+
+struct ZMap
+{
+    ZTab ht1;
+    ZTab ht2;
+    uint32_t resizing_pos = 0;
+};
+
+// what a set still stores as integers. A new set starts with both: scores
+// while every score is integral, members while every name is the canonical
+// decimal form of an int64. The first value that does not fit converts the
+// set for good.
+enum
+{
+    ZSET_INT_SCORES = 1,
+    ZSET_INT_NAMES = 2,
+};
+
 struct Zset
 {
-    AVLNode *tree = NULL;
-    HMap hmap;
+    ZRef root = 0;
+    uint8_t ints = ZSET_INT_SCORES | ZSET_INT_NAMES;
+    ZMap map;
+    ZArena arena;
+    // when set, member names live in the pool instead of the nodes.
+    // it must not change while the set has members.
+    ZNamePool *pool = NULL;
+    // bumped on every change, cached replies compare against it
+    uint64_t version = 0;
 };
 
+// Znode::cnt is the size of the subtree above the balance factor, which is
+// height(right) - height(left) stored as balance + 2 in the low bits
+const uint32_t k_zbal_bits = 3;
+const uint32_t k_zbal_mask = (1u << k_zbal_bits) - 1;
+const uint32_t k_zset_max = UINT32_MAX >> k_zbal_bits;
+
+// Znode::len flag: buf holds a pointer to the name (interned, or too long)
+const uint32_t k_zname_ptr = 1u << 31;
+
+// "-9223372036854775808"
+const size_t k_zint_max_len = 20;
+
 struct Znode
 {
-    AVLNode tree;
-    HNode hmap;
-    double score = 0;
-    size_t len = 0;
-    char name[0];
+    ZRef left = 0;
+    ZRef right = 0;
+    ZRef parent = 0;
+    uint32_t cnt = 0;
+    ZRef next = 0;      // the member table chain
+    uint32_t hcode = 0; // str_hash() of the name, truncated
+    double sum = 0;     // of the scores over the subtree, for ZSUMRANGE
+    union
+    {
+        double dscore = 0;
+        int64_t iscore;
+    };
+    // an integer member is stored in place of len and buf
+    uint32_t len = 0;
+    char buf[0];
 };
 
-Znode *znode_new(const char *name, size_t len, double score);
+// a member name: a view into the node or the name pool, or an integer
+// member written out to buf
+struct ZMember
+{
+    const char *name = NULL;
+    uint32_t len = 0;
+    char buf[k_zint_max_len];
+};
+
+// in-order iteration in either direction
+struct ZIter
+{
+    Zset *zset = NULL;
+    Znode *node = NULL;
+    bool reverse = false;
+};
+
+// loading members that arrive in (score, name) order, as a snapshot stores
+// them: the tree is built in arrival order and the sort is skipped
+struct ZLoad
+{
+    std::vector<ZRef> nodes;
+    bool sorted = true; // cleared by the first member out of order or repeated
+};
 
-void tree_add(Zset *zset, Znode *node);
+const char *zname_acquire(ZNamePool *pool, const char *name, size_t len, uint64_t hcode);
 
-bool zless(AVLNode *lhs, double score, const char *name, size_t len);
+const char *zname_find(ZNamePool *pool, const char *name, size_t len, uint64_t hcode);
 
-bool zless(AVLNode *lhs, AVLNode *rhs);
+void zname_release(ZNamePool *pool, const char *name);
+
+void znode_member(const Zset *zset, const Znode *node, ZMember *member);
+
+double znode_score(const Zset *zset, const Znode *node);
 
 void zset_update(Zset *zset, Znode *node, double score);
 
 bool zset_add(Zset *zset, const char *name, size_t len, double score);
 
-bool znode_cmp(HNode *node, HNode *key);
+void zset_delete(Zset *zset, Znode *node);
+
+size_t zset_size(const Zset *zset);
 
 Znode *zset_lookup(Zset *zset, const char *name, size_t len);
 
-Znode *zset_query(Zset *zset, double score, const char *name, size_t len, int64_t offset);
\ No newline at end of file
+Znode *zset_query(Zset *zset, double score, const char *name, size_t len, int64_t offset);
+
+void zset_reserve(Zset *zset, size_t n);
+
+bool zset_bulk_add(Zset *zset, const char *name, size_t len, double score);
+
+void zset_bulk_build(Zset *zset);
+
+void zset_load_add(Zset *zset, ZLoad *load, const char *name, size_t len, double score);
+
+void zset_load_build(Zset *zset, ZLoad *load);
+
+Znode *zset_at(Zset *zset, int64_t rank);
+
+int64_t zset_rank(Zset *zset, Znode *node);
+
+Znode *zset_seek_score(Zset *zset, double score, bool inclusive);
+
+double zset_sum_rank(Zset *zset, int64_t lo, int64_t hi);
+
+Znode *zset_first(Zset *zset);
+
+Znode *zset_last(Zset *zset);
+
+Znode *znode_next(Zset *zset, Znode *node);
+
+Znode *znode_prev(Zset *zset, Znode *node);
+
+ZIter zset_iter(Zset *zset, int64_t rank, bool reverse);
+
+Znode *ziter_next(ZIter *iter);
+
+void zset_dispose(Zset *zset);